@@ -1,43 +1,258 @@
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
-#include <condition_variable>
+#include <climits>
 #include <cstring>
-#include <mutex>
+#include <immintrin.h>
+#include <linux/futex.h>
 #include <random>
+#include <sys/syscall.h>
 #include <thread>
+#include <unistd.h>
+#include <vector>
 
 static constexpr size_t MEM_SIZE = 256 * 1024 * 1024;
 
 static std::mt19937 rnd;
 
+/**
+ * Copy kernels: unaligned loads, stores aligned to the vector width after
+ * an unaligned head, an overlapping unaligned tail. With streaming the
+ * stores are non-temporal: they bypass the cache and skip reading the
+ * destination lines for ownership, which pays off once the copy does not
+ * fit in the last level cache anyway.
+ */
+using CopyKernel = void (*)(void* dst, const void* src, size_t size, bool streaming);
+
+#define DEFINE_COPY_KERNEL(NAME, TARGET, VEC, LOADU, STOREU, STORE, STREAM)                 \
+    __attribute__((target(TARGET))) static void NAME(void* dst, const void* src, size_t size, \
+                                                     bool streaming) {                       \
+        constexpr size_t WIDTH = sizeof(VEC);                                                \
+        if (size < 2 * WIDTH) {                                                              \
+            memcpy(dst, src, size);                                                          \
+            return;                                                                          \
+        }                                                                                    \
+        char *d = (char *)dst, *end = d + size;                                              \
+        const char *s = (const char *)src;                                                   \
+        STOREU((VEC *)d, LOADU((const VEC *)s));                                             \
+        size_t head = WIDTH - ((uintptr_t)d & (WIDTH - 1));                                  \
+        d += head;                                                                           \
+        s += head;                                                                           \
+        char *last = end - WIDTH;                                                            \
+        if (streaming) {                                                                     \
+            for (; d + 4 * WIDTH <= last; d += 4 * WIDTH, s += 4 * WIDTH) {                  \
+                VEC a = LOADU((const VEC *)s), b = LOADU((const VEC *)(s + WIDTH));          \
+                VEC c = LOADU((const VEC *)(s + 2 * WIDTH));                                 \
+                VEC e = LOADU((const VEC *)(s + 3 * WIDTH));                                 \
+                STREAM((VEC *)d, a);                                                         \
+                STREAM((VEC *)(d + WIDTH), b);                                               \
+                STREAM((VEC *)(d + 2 * WIDTH), c);                                           \
+                STREAM((VEC *)(d + 3 * WIDTH), e);                                           \
+            }                                                                                \
+            for (; d < last; d += WIDTH, s += WIDTH) {                                       \
+                STREAM((VEC *)d, LOADU((const VEC *)s));                                     \
+            }                                                                                \
+            /* orders the streaming stores before the tail and the caller's next stores */   \
+            _mm_sfence();                                                                    \
+        } else {                                                                             \
+            for (; d + 4 * WIDTH <= last; d += 4 * WIDTH, s += 4 * WIDTH) {                  \
+                VEC a = LOADU((const VEC *)s), b = LOADU((const VEC *)(s + WIDTH));          \
+                VEC c = LOADU((const VEC *)(s + 2 * WIDTH));                                 \
+                VEC e = LOADU((const VEC *)(s + 3 * WIDTH));                                 \
+                STORE((VEC *)d, a);                                                          \
+                STORE((VEC *)(d + WIDTH), b);                                                \
+                STORE((VEC *)(d + 2 * WIDTH), c);                                            \
+                STORE((VEC *)(d + 3 * WIDTH), e);                                            \
+            }                                                                                \
+            for (; d < last; d += WIDTH, s += WIDTH) {                                       \
+                STORE((VEC *)d, LOADU((const VEC *)s));                                      \
+            }                                                                                \
+        }                                                                                    \
+        STOREU((VEC *)last, LOADU((const VEC *)(s + (last - d))));                           \
+    }
+
+DEFINE_COPY_KERNEL(CopySse2, "sse2", __m128i, _mm_loadu_si128, _mm_storeu_si128, _mm_store_si128, _mm_stream_si128)
+DEFINE_COPY_KERNEL(CopyAvx2, "avx2", __m256i, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_store_si256,
+                   _mm256_stream_si256)
+DEFINE_COPY_KERNEL(CopyAvx512, "avx512f", __m512i, _mm512_loadu_si512, _mm512_storeu_si512, _mm512_store_si512,
+                   _mm512_stream_si512)
+
+#undef DEFINE_COPY_KERNEL
+
+static void CopyLibc(void* dst, const void* src, size_t size, bool) {
+    memcpy(dst, src, size);
+}
+
+struct CopyKernelInfo {
+    const char *name;
+    CopyKernel copy;
+    bool supported;
+};
+
+// best first; __builtin_cpu_supports reads CPUID and checks that the OS saves the registers
+static const std::vector<CopyKernelInfo>& CopyKernels() {
+    static const std::vector<CopyKernelInfo> kernels = {
+        {"avx512", CopyAvx512, (bool)__builtin_cpu_supports("avx512f")},
+        {"avx2", CopyAvx2, (bool)__builtin_cpu_supports("avx2")},
+        {"sse2", CopySse2, (bool)__builtin_cpu_supports("sse2")},
+        {"libc", CopyLibc, true},
+    };
+    return kernels;
+}
+
+// copies whose source and destination together exceed the last level cache stream
+static size_t StreamingThreshold() {
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (llc <= 0) {
+        llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    }
+    return llc > 0 ? llc / 2 : 8 << 20;
+}
+
+static const size_t streaming_threshold = StreamingThreshold();
+
+/**
+ * The kernel for streaming copies, timed once against glibc on a copy of
+ * streaming_threshold bytes, best of three: whether non-temporal stores of
+ * a given width beat glibc depends on the machine. libc wins ties.
+ */
+static const CopyKernelInfo& StreamingKernel() {
+    static const CopyKernelInfo& kernel = [] {
+        std::vector<char> src(streaming_threshold, 1), dst(streaming_threshold, 2);
+        const CopyKernelInfo *best = nullptr;
+        double bestTime = 1e300;
+        for (auto it = CopyKernels().rbegin(); it != CopyKernels().rend(); ++it) {
+            if (!it->supported) {
+                continue;
+            }
+            for (int round = 0; round < 3; ++round) {
+                auto from = std::chrono::steady_clock::now();
+                it->copy(dst.data(), src.data(), src.size(), true);
+                double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - from).count();
+                if (time < bestTime) {
+                    bestTime = time;
+                    best = &*it;
+                }
+            }
+        }
+        return *best;
+    }();
+    return kernel;
+}
+
+/**
+ * A 32-bit word threads wait on for a new value: they spin for a while,
+ * then sleep in futex(2). Waking costs a syscall only if someone sleeps.
+ * Each word has its own cache line.
+ */
+class alignas(64) SpinFutex {
+public:
+    uint32_t Load() const {
+        return value_.load(std::memory_order_acquire);
+    }
+
+    void Store(uint32_t value) {
+        // seq_cst against the waiters_ increment in WaitWhile, so that
+        // either the waiter sees the value or this sees the waiter
+        value_.store(value, std::memory_order_seq_cst);
+        if (waiters_.load(std::memory_order_seq_cst) != 0) {
+            syscall(SYS_futex, &value_, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    // returns the first value other than old
+    uint32_t WaitWhile(uint32_t old) {
+        for (unsigned spin = 0; spin < SPIN_ITERATIONS; ++spin) {
+            uint32_t value = value_.load(std::memory_order_acquire);
+            if (value != old) {
+                return value;
+            }
+            CpuRelax();
+        }
+        while (true) {
+            waiters_.fetch_add(1, std::memory_order_seq_cst);
+            uint32_t value = value_.load(std::memory_order_seq_cst);
+            if (value == old) {
+                // returns at once if the value changed in between
+                syscall(SYS_futex, &value_, FUTEX_WAIT_PRIVATE, old, nullptr, nullptr, 0);
+                value = value_.load(std::memory_order_acquire);
+            }
+            waiters_.fetch_sub(1, std::memory_order_relaxed);
+            if (value != old) {
+                return value;
+            }
+        }
+    }
+
+private:
+    static constexpr unsigned SPIN_ITERATIONS = 1 << 14;
+
+    static void CpuRelax() {
+        #if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+        #endif
+    }
+
+    std::atomic<uint32_t> value_{0};
+    std::atomic<uint32_t> waiters_{0};
+};
+
+/**
+ * Splits a copy between the calling thread and helpers of the pool.
+ * A copy is started by bumping the sequence counter all helpers wait on,
+ * its low bits carry the number of helpers taking part, so that helpers
+ * left out read nothing else. Each helper stores the sequence word into its
+ * own completion flag when its part is done. The number of helpers grows with the size of the copy
+ * and never exceeds the other cores of the machine, so small copies are a
+ * plain memcpy on the calling thread.
+ */
 class MemcpyPool {
 private:
+    // no helper is woken for less
+    static constexpr size_t MIN_PARALLEL_SIZE = 1 << 20;
+    // the least each thread copies
+    static constexpr size_t MIN_PART_SIZE = 512 * 1024;
+    static constexpr unsigned HELPER_BITS = 8;
+    static constexpr size_t MAX_HELPERS = (1 << HELPER_BITS) - 1;
+
     void Run(size_t i) {
-        size_t local_run_step = 0;
+        uint32_t seen = 0;
         while (true) {
-            ++local_run_step;
-            {
-                std::unique_lock lock{mutex_};
-                tpool_var_.wait(lock, [&](){
-                    return closed_ || run_step_ == local_run_step;
-                });
-            }
-            if (closed_) {
+            seen = sequence_.WaitWhile(seen);
+            if (closed_.load(std::memory_order_acquire)) {
                 break;
             }
-            size_t csize = size / (pool_size + 1);
-            memcpy((char *)dst + csize * i, (char *)src + csize * i, csize);
-            {
-                std::unique_lock lock{mutex_};
-                ++completed_;
-                if (completed_ == pool_size) {
-                    manager_var_.notify_one();
-                }
+            size_t helpers = seen & MAX_HELPERS;
+            if (i >= helpers) {
+                continue;
             }
+            size_t csize = size / (helpers + 1);
+            CopyPart((char *)dst + csize * i, (char *)src + csize * i, csize);
+            done_[i].Store(seen);
         }
     }
+
+    void CopyPart(void* dst, const void* src, size_t size) const {
+        if (streaming_) {
+            streaming_kernel_(dst, src, size, true);
+        } else {
+            memcpy(dst, src, size);
+        }
+    }
+
+    size_t HelpersFor(size_t size) const {
+        if (size < MIN_PARALLEL_SIZE) {
+            return 0;
+        }
+        return std::min({pool_size, MAX_HELPERS, cores_ - 1, size / MIN_PART_SIZE - 1});
+    }
+
 public:
-    MemcpyPool(size_t pool_size) : pool_size(pool_size) {
+    // hardware_concurrency() reads sysfs, so it is asked once and not per copy
+    MemcpyPool(size_t pool_size)
+        : pool_size(pool_size), cores_(std::max(1u, std::thread::hardware_concurrency())),
+          streaming_kernel_(StreamingKernel().copy), done_(pool_size) {
         threads_.reserve(pool_size);
         for (size_t i = 0; i < pool_size; ++i) {
             threads_.emplace_back(&MemcpyPool::Run, this, i);
@@ -45,51 +260,62 @@ public:
     }
 
     void StartFor(void* dst, const void* src, size_t size) {
-        std::unique_lock lock{mutex_};
         this->dst = dst;
         this->src = src;
         this->size = size;
-        ++run_step_;
-        tpool_var_.notify_all();
+        helpers_ = HelpersFor(size);
+        // decided on the whole copy, not on the part of each thread
+        streaming_ = size >= streaming_threshold;
+        if (helpers_ > 0) {
+            word_ = ++step_ << HELPER_BITS | helpers_;
+            sequence_.Store(word_);
+        }
     }
 
     void WaitStep() {
-        std::unique_lock lock{mutex_};
-        manager_var_.wait(lock, [&](){
-            return completed_ == pool_size;
-        });
-        completed_ = 0;
+        for (size_t i = 0; i < helpers_; ++i) {
+            for (uint32_t done = done_[i].Load(); done != word_;) {
+                done = done_[i].WaitWhile(done);
+            }
+        }
     }
 
     void* parallel_memcpy(void* dst, const void* src, size_t size) {
         StartFor(dst, src, size);
-        size_t offset = (size / (pool_size + 1)) * pool_size;
-        memcpy((char *)dst + offset, (char *)src + offset, size - offset);
+        if (helpers_ == 0) {
+            return memcpy(dst, src, size);
+        }
+        size_t offset = (size / (helpers_ + 1)) * helpers_;
+        CopyPart((char *)dst + offset, (char *)src + offset, size - offset);
         WaitStep();
         return dst;
     }
 
     ~MemcpyPool() {
-        std::unique_lock lock{mutex_};
-        closed_ = true;
-        tpool_var_.notify_all();
+        closed_.store(true, std::memory_order_release);
+        sequence_.Store(++step_ << HELPER_BITS);
+        threads_.clear();
     }
 
 private:
     char pad[128];
     size_t pool_size;
+    size_t cores_;
+    CopyKernel streaming_kernel_;
     void *dst;
     const void *src;
     size_t size;
+    size_t helpers_{0};
+    bool streaming_{false};
+    uint32_t step_{0};
+    // the last sequence word published
+    uint32_t word_{0};
     char pad2[128];
 private:
     std::vector<std::jthread> threads_;
-    std::mutex mutex_;
-    std::condition_variable tpool_var_;
-    std::condition_variable manager_var_;
-    size_t run_step_{0};
-    size_t completed_{0};
-    bool closed_{false};
+    SpinFutex sequence_;
+    std::vector<SpinFutex> done_;
+    std::atomic<bool> closed_{false};
 };
 
 
@@ -111,6 +337,25 @@ int main() {
     auto time =  std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
     assert(memcmp(smem.data(), dmem.data(), smem.size()) == 0);
     fprintf(stderr, "Default memcpy time:\t %ld microseconds\n", time);
+    for (const auto& kernel : CopyKernels()) {
+        if (!kernel.supported) {
+            continue;
+        }
+        for (bool streaming : {false, true}) {
+            if (streaming && kernel.copy == CopyLibc) {
+                continue;
+            }
+            init_mem(dmem.data(), dmem.size());
+            from = std::chrono::steady_clock::now();
+            kernel.copy(dmem.data(), smem.data(), smem.size(), streaming);
+            to = std::chrono::steady_clock::now();
+            time =  std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+            assert(memcmp(smem.data(), dmem.data(), smem.size()) == 0);
+            fprintf(stderr, "Kernel %s%s, time:\t %ld microseconds\n",
+                    kernel.name, streaming ? " streaming" : "", time);
+        }
+    }
+    fprintf(stderr, "Streaming kernel:\t %s\n", StreamingKernel().name);
     for (size_t pool_size = 0; pool_size <= 8; ++pool_size) {
         init_mem(dmem.data(), dmem.size());
         MemcpyPool pool{pool_size};
@@ -121,5 +366,26 @@ int main() {
         fprintf(stderr, "Pool size: %lu, time:\t %ld microseconds\n", pool_size, time);
         assert(memcmp(smem.data(), dmem.data(), smem.size()) == 0);
     }
+    MemcpyPool pool{8};
+    for (size_t size = 4 * 1024; size <= MEM_SIZE; size *= 4) {
+        size_t repeats = std::max<size_t>(1, (64 << 20) / size);
+        // best of alternating rounds, so that neither side gets the warm caches
+        double plain = 1e300, pooled = 1e300;
+        for (int round = 0; round < 3; ++round) {
+            from = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < repeats; ++i) {
+                memcpy(dmem.data(), smem.data(), size);
+            }
+            plain = std::min(plain, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - from).count());
+            from = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < repeats; ++i) {
+                pool.parallel_memcpy(dmem.data(), smem.data(), size);
+            }
+            pooled = std::min(pooled, std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - from).count());
+        }
+        assert(memcmp(smem.data(), dmem.data(), size) == 0);
+        fprintf(stderr, "Size: %lu KiB, memcpy:\t %.2f, pool of 8:\t %.2f microseconds\n",
+                size / 1024, plain / repeats, pooled / repeats);
+    }
     return 0;
 }
\ No newline at end of file
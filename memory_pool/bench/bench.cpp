@@ -0,0 +1,548 @@
+#include "mem_pool.h"
+#include "numa_pool.h"
+#include "pool_resource.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Allocator benchmark: runs one workload against every allocator and
+ * prints one CSV row (or JSON object) per allocator.
+ *
+ *   mempool_bench [--allocator NAME|all] [--threads N] [--ops N]
+ *                 [--sizes fixed:S|uniform:MIN-MAX|pow2:MIN-MAX]
+ *                 [--free-ratio R] [--lifetime N]
+ *                 [--pattern local|producer-consumer] [--format csv|json]
+ *                 [--prefault lazy|populate|background]
+ *
+ * Every thread performs ops allocations. An object stays alive for the next
+ * lifetime allocations of its thread (or sits that long in the queue to
+ * its consumer) and is then freed with probability 1 / free-ratio; the
+ * others are kept until the end of the run. Every allocator runs in a
+ * forked child, so RSS figures do not leak from one run into the next;
+ * a failed run is reported on stderr and left out of the output.
+ * Page faults are counted on the benchmark threads only, a background
+ * prefault helper's own faults are not included. --prefault applies to the
+ * pool allocators.
+ * Pmr* allocators are std::pmr::polymorphic_allocator over the named
+ * memory resource.
+ */
+
+static constexpr unsigned LATENCY_SAMPLE_PERIOD = 16;
+
+struct Config {
+  std::string allocator = "all";
+  std::string pattern = "local";
+  std::string format = "csv";
+  std::string sizes = "fixed:16";
+  std::string prefault = "lazy";
+  unsigned threads = 4;
+  unsigned long long ops = 1'000'000;
+  double freeRatio = 1.0;
+  unsigned lifetime = 1024;
+};
+
+struct Result {
+  unsigned threads = 0;
+  double seconds = 0;
+  unsigned long long ops = 0;
+  unsigned long long p50 = 0, p99 = 0;
+  long long rss = 0;
+  unsigned long long liveBytes = 0;
+  long long minorFaults = 0, majorFaults = 0;
+};
+
+class SizeDistribution {
+private:
+  enum class Kind { Fixed, Uniform, Pow2 } kind;
+  size_t min, max;
+
+public:
+  explicit SizeDistribution(const std::string& spec) {
+    auto colon = spec.find(':');
+    if (colon == std::string::npos) {
+      throw std::invalid_argument("bad --sizes: " + spec);
+    }
+    std::string name = spec.substr(0, colon);
+    std::string range = spec.substr(colon + 1);
+    auto dash = range.find('-');
+    min = std::stoul(range.substr(0, dash));
+    max = dash == std::string::npos ? min : std::stoul(range.substr(dash + 1));
+    if (name == "fixed") {
+      kind = Kind::Fixed;
+    } else if (name == "uniform") {
+      kind = Kind::Uniform;
+    } else if (name == "pow2") {
+      kind = Kind::Pow2;
+    } else {
+      throw std::invalid_argument("bad --sizes: " + spec);
+    }
+    if (min == 0 || max < min) {
+      throw std::invalid_argument("bad --sizes: " + spec);
+    }
+  }
+
+  size_t operator()(std::mt19937_64& rnd) const {
+    switch (kind) {
+      case Kind::Fixed:
+        return min;
+      case Kind::Uniform:
+        return min + rnd() % (max - min + 1);
+      case Kind::Pow2: {
+        unsigned lo = std::bit_width(min - 1), hi = std::bit_width(max - 1);
+        return std::clamp<size_t>(size_t(1) << (lo + rnd() % (hi - lo + 1)), min, max);
+      }
+    }
+    return min;
+  }
+};
+
+struct Object {
+  std::byte* ptr = nullptr;
+  size_t size = 0;
+  bool keep = false;
+};
+
+/**
+ * Per-thread part of the measurements: sampled allocation latencies and
+ * the bytes still alive at the end of the timed phase.
+ */
+struct ThreadStats {
+  std::vector<unsigned> latencies;
+  // bytes allocated minus bytes freed by this thread, negative for consumers
+  long long liveBytes = 0;
+  long long minorFaults = 0, majorFaults = 0;
+};
+
+template <typename Allocator>
+class Worker {
+private:
+  using Traits = std::allocator_traits<Allocator>;
+  Allocator& alloc_;
+  std::mt19937_64 rnd_;
+  const SizeDistribution& sizes_;
+  double freeRatio_;
+  std::vector<Object> kept_;
+
+public:
+  ThreadStats stats;
+
+  // bookkeeping is reserved up front to keep it out of the RSS figures
+  Worker(Allocator& alloc, unsigned seed, const SizeDistribution& sizes, double freeRatio,
+         unsigned long long ops)
+      : alloc_(alloc), rnd_(seed), sizes_(sizes), freeRatio_(freeRatio) {
+    stats.latencies.reserve(ops / LATENCY_SAMPLE_PERIOD + 1);
+    kept_.reserve((ops - ops / freeRatio) * 1.1 + 16);
+  }
+
+  Object allocate(unsigned long long i) {
+    size_t size = sizes_(rnd_);
+    Object obj{nullptr, size, freeRatio_ > 1 && rnd_() % 1'000'000 >= 1'000'000 / freeRatio_};
+    if (i % LATENCY_SAMPLE_PERIOD == 0) {
+      auto from = std::chrono::steady_clock::now();
+      obj.ptr = Traits::allocate(alloc_, size);
+      auto to = std::chrono::steady_clock::now();
+      stats.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+    } else {
+      obj.ptr = Traits::allocate(alloc_, size);
+    }
+    *obj.ptr = std::byte(i);
+    stats.liveBytes += size;
+    return obj;
+  }
+
+  void free(const Object& obj) {
+    if (!obj.ptr) {
+      return;
+    }
+    if (obj.keep) {
+      kept_.push_back(obj);
+      return;
+    }
+    Traits::deallocate(alloc_, obj.ptr, obj.size);
+    stats.liveBytes -= obj.size;
+  }
+
+  // benchmark's own memory touched during the run, excluded from RSS
+  size_t bookkeepingBytes() const {
+    return kept_.size() * sizeof(Object) + stats.latencies.size() * sizeof(unsigned);
+  }
+
+  void freeKept() {
+    for (auto& obj : kept_) {
+      Traits::deallocate(alloc_, obj.ptr, obj.size);
+    }
+    kept_.clear();
+  }
+};
+
+// bounded single-producer single-consumer queue
+class Channel {
+private:
+  std::vector<Object> ring_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+
+public:
+  explicit Channel(size_t capacity) : ring_(capacity) {}
+
+  void push(const Object& obj) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    while (tail - head_.load(std::memory_order_acquire) == ring_.size()) {
+      std::this_thread::yield();
+    }
+    ring_[tail % ring_.size()] = obj;
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  Object pop() {
+    size_t head = head_.load(std::memory_order_relaxed);
+    while (tail_.load(std::memory_order_acquire) == head) {
+      std::this_thread::yield();
+    }
+    Object obj = ring_[head % ring_.size()];
+    head_.store(head + 1, std::memory_order_release);
+    return obj;
+  }
+};
+
+static PoolOptions poolOptions(const Config& config) {
+  PoolOptions options;
+  if (config.prefault == "populate") {
+    options.prefault = Prefault::Populate;
+  } else if (config.prefault == "background") {
+    options.prefault = Prefault::Background;
+  }
+  return options;
+}
+
+static long long getCurrentRSS() {
+  long long rss = 0;
+  FILE* fp = fopen("/proc/self/statm", "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  if (fscanf(fp, "%*s%lld", &rss) != 1) {
+    rss = 0;
+  }
+  fclose(fp);
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * Runs the workload with one shared allocator, or with one allocator per
+ * thread if perThread is set (pools which are not thread-safe).
+ */
+template <template <typename> typename Allocator, bool perThread>
+static Result runWorkload(const Config& config) {
+  using Alloc = Allocator<std::byte>;
+  SizeDistribution sizes{config.sizes};
+  bool pc = config.pattern == "producer-consumer";
+  unsigned threadsNum = pc ? std::max(2u, config.threads / 2 * 2) : config.threads;
+
+  std::vector<std::unique_ptr<Alloc>> allocs(perThread ? threadsNum : 1);
+  for (auto& alloc : allocs) {
+    if constexpr (std::constructible_from<Alloc, const PoolOptions&>) {
+      alloc = std::make_unique<Alloc>(poolOptions(config));
+    } else {
+      alloc = std::make_unique<Alloc>();
+    }
+  }
+  auto allocFor = [&](unsigned i) -> Alloc& { return *allocs[perThread ? i : 0]; };
+
+  std::vector<std::unique_ptr<Worker<Alloc>>> workers(threadsNum);
+  for (unsigned i = 0; i < threadsNum; ++i) {
+    workers[i] = std::make_unique<Worker<Alloc>>(allocFor(i), i + 1, sizes, config.freeRatio, config.ops);
+  }
+  std::vector<std::unique_ptr<Channel>> channels;
+  if (pc) {
+    for (unsigned i = 0; i < threadsNum / 2; ++i) {
+      channels.push_back(std::make_unique<Channel>(std::max(1u, config.lifetime)));
+    }
+  }
+
+  std::vector<std::vector<Object>> windows(threadsNum);
+  if (!pc) {
+    for (auto& window : windows) {
+      window.resize(std::max(1u, config.lifetime));
+    }
+  }
+  long long startRss = getCurrentRSS();
+  std::atomic<unsigned> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::jthread> threads;
+  threads.reserve(threadsNum);
+  for (unsigned t = 0; t < threadsNum; ++t) {
+    threads.emplace_back([&, t](){
+      Worker<Alloc>& worker = *workers[t];
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {}
+      struct rusage usageFrom, usageTo;
+      getrusage(RUSAGE_THREAD, &usageFrom);
+      if (!pc) {
+        auto& window = windows[t];
+        for (unsigned long long i = 0; i < config.ops; ++i) {
+          Object& slot = window[i % window.size()];
+          worker.free(slot);
+          slot = worker.allocate(i);
+        }
+      } else if (t % 2 == 0) {
+        Channel& ch = *channels[t / 2];
+        for (unsigned long long i = 0; i < config.ops; ++i) {
+          ch.push(worker.allocate(i));
+        }
+      } else {
+        Channel& ch = *channels[t / 2];
+        for (unsigned long long i = 0; i < config.ops; ++i) {
+          worker.free(ch.pop());
+        }
+      }
+      getrusage(RUSAGE_THREAD, &usageTo);
+      worker.stats.minorFaults = usageTo.ru_minflt - usageFrom.ru_minflt;
+      worker.stats.majorFaults = usageTo.ru_majflt - usageFrom.ru_majflt;
+    });
+  }
+  while (ready.load() != threadsNum) {}
+  auto from = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto to = std::chrono::steady_clock::now();
+
+  Result result;
+  result.threads = threadsNum;
+  result.seconds = std::chrono::duration<double>(to - from).count();
+  result.ops = config.ops * (pc ? threadsNum / 2 : threadsNum);
+  result.rss = getCurrentRSS() - startRss;
+  std::vector<unsigned> latencies;
+  long long live = 0;
+  for (auto& worker : workers) {
+    result.rss -= worker->bookkeepingBytes();
+    latencies.insert(latencies.end(), worker->stats.latencies.begin(), worker->stats.latencies.end());
+    live += worker->stats.liveBytes;
+    result.minorFaults += worker->stats.minorFaults;
+    result.majorFaults += worker->stats.majorFaults;
+  }
+  result.liveBytes = std::max(0ll, live);
+  if (!latencies.empty()) {
+    auto nth = [&](double q) {
+      auto it = latencies.begin() + (size_t)(q * (latencies.size() - 1));
+      std::nth_element(latencies.begin(), it, latencies.end());
+      return *it;
+    };
+    result.p50 = nth(0.50);
+    result.p99 = nth(0.99);
+  }
+
+  for (unsigned t = 0; t < threadsNum; ++t) {
+    for (auto& obj : windows[t]) {
+      workers[t]->free(obj);
+    }
+    workers[t]->freeKept();
+  }
+  return result;
+}
+
+template <typename Resource>
+struct ResourceHolder {
+  Resource owned;
+
+  template <typename... Args>
+  explicit ResourceHolder(Args&&... args) : owned(std::forward<Args>(args)...) {}
+};
+
+// polymorphic_allocator which owns its resource, base order makes the
+// resource outlive the allocator part
+template <typename Resource>
+struct ResourceAllocator : ResourceHolder<Resource>, std::pmr::polymorphic_allocator<std::byte> {
+  ResourceAllocator() : std::pmr::polymorphic_allocator<std::byte>(&this->owned) {}
+
+  explicit ResourceAllocator(const PoolOptions& options) requires std::constructible_from<Resource, const PoolOptions&>
+      : ResourceHolder<Resource>(options), std::pmr::polymorphic_allocator<std::byte>(&this->owned) {}
+};
+
+template <typename Resource>
+struct Pmr {
+  template <typename>
+  using Allocator = ResourceAllocator<Resource>;
+};
+
+static void printResult(const Config& config, const std::string& name, const Result& r) {
+  double overhead = r.rss > 0 ? std::max(0.0, (r.rss - (double)r.liveBytes) * 100 / r.rss) : 0;
+  if (config.format == "json") {
+    printf("{\"allocator\": \"%s\", \"pattern\": \"%s\", \"threads\": %u, \"sizes\": \"%s\", "
+           "\"free_ratio\": %.2f, \"lifetime\": %u, \"ops\": %llu, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.0f, \"p50_ns\": %llu, \"p99_ns\": %llu, \"rss_bytes\": %lld, "
+           "\"live_bytes\": %llu, \"overhead_pct\": %.1f, \"prefault\": \"%s\", "
+           "\"minor_faults\": %lld, \"major_faults\": %lld}",
+           name.c_str(), config.pattern.c_str(), r.threads, config.sizes.c_str(),
+           config.freeRatio, config.lifetime, r.ops, r.seconds, r.ops / r.seconds,
+           r.p50, r.p99, r.rss, r.liveBytes, overhead, config.prefault.c_str(),
+           r.minorFaults, r.majorFaults);
+  } else {
+    printf("%s,%s,%u,%s,%.2f,%u,%llu,%.6f,%.0f,%llu,%llu,%lld,%llu,%.1f,%s,%lld,%lld\n",
+           name.c_str(), config.pattern.c_str(), r.threads, config.sizes.c_str(),
+           config.freeRatio, config.lifetime, r.ops, r.seconds, r.ops / r.seconds,
+           r.p50, r.p99, r.rss, r.liveBytes, overhead, config.prefault.c_str(),
+           r.minorFaults, r.majorFaults);
+  }
+}
+
+struct Candidate {
+  const char* name;
+  bool supportsSharing;
+  std::function<Result(const Config&)> run;
+};
+
+static const std::vector<Candidate> candidates = {
+  {"Default", true, runWorkload<std::allocator, false>},
+  {"LocalMemPool", false, runWorkload<MemPoolAllocator, true>},
+  {"MutexedMemPool", true, runWorkload<MutexedMemPoolAllocator, false>},
+  {"LockFreeMemPool", true, runWorkload<LockFreeMemPoolAllocator, false>},
+  {"CachedMemPool", true, runWorkload<ThreadCachedMemPoolAllocator, false>},
+  {"NumaMutexedMemPool", true, runWorkload<NumaMutexedMemPoolAllocator, false>},
+  {"NumaLockFreeMemPool", true, runWorkload<NumaLockFreeMemPoolAllocator, false>},
+  {"PmrMonotonic", false, runWorkload<Pmr<std::pmr::monotonic_buffer_resource>::Allocator, true>},
+  {"PmrUnsyncPool", false, runWorkload<Pmr<std::pmr::unsynchronized_pool_resource>::Allocator, true>},
+  {"PmrSyncPool", true, runWorkload<Pmr<std::pmr::synchronized_pool_resource>::Allocator, false>},
+  {"PmrLocalMemPool", false, runWorkload<Pmr<LocalPoolResource>::Allocator, true>},
+  {"PmrMutexedMemPool", true, runWorkload<Pmr<MutexedPoolResource>::Allocator, false>},
+  {"PmrLockFreeMemPool", true, runWorkload<Pmr<LockFreePoolResource>::Allocator, false>},
+  {"PmrCachedMemPool", true, runWorkload<Pmr<CachedPoolResource>::Allocator, false>},
+};
+
+static Config parseArgs(int argc, const char* argv[]) {
+  Config config;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (i + 1 == argc) {
+      throw std::invalid_argument("missing value for " + arg);
+    }
+    std::string value = argv[++i];
+    if (arg == "--allocator") {
+      config.allocator = value;
+    } else if (arg == "--pattern") {
+      config.pattern = value;
+    } else if (arg == "--format") {
+      config.format = value;
+    } else if (arg == "--sizes") {
+      config.sizes = value;
+    } else if (arg == "--threads") {
+      config.threads = std::stoul(value);
+    } else if (arg == "--ops") {
+      config.ops = std::stoull(value);
+    } else if (arg == "--free-ratio") {
+      config.freeRatio = std::stod(value);
+    } else if (arg == "--prefault") {
+      config.prefault = value;
+    } else if (arg == "--lifetime") {
+      config.lifetime = std::stoul(value);
+    } else {
+      throw std::invalid_argument("unknown option " + arg);
+    }
+  }
+  if (config.pattern != "local" && config.pattern != "producer-consumer") {
+    throw std::invalid_argument("bad --pattern: " + config.pattern);
+  }
+  if (config.format != "csv" && config.format != "json") {
+    throw std::invalid_argument("bad --format: " + config.format);
+  }
+  if (config.prefault != "lazy" && config.prefault != "populate" && config.prefault != "background") {
+    throw std::invalid_argument("bad --prefault: " + config.prefault);
+  }
+  if (config.freeRatio < 1) {
+    throw std::invalid_argument("--free-ratio must be >= 1");
+  }
+  SizeDistribution{config.sizes};
+  return config;
+}
+
+int main(int argc, const char* argv[]) {
+  Config config;
+  try {
+    config = parseArgs(argc, argv);
+  } catch (const std::exception& e) {
+    fprintf(stderr, "%s\n", e.what());
+    return EXIT_FAILURE;
+  }
+  installGuardPageHandler();
+
+  bool pc = config.pattern == "producer-consumer";
+  if (config.format == "json") {
+    printf("[\n");
+  } else {
+    printf("allocator,pattern,threads,sizes,free_ratio,lifetime,ops,seconds,ops_per_sec,"
+           "p50_ns,p99_ns,rss_bytes,live_bytes,overhead_pct,prefault,minor_faults,major_faults\n");
+  }
+  bool first = true;
+  for (auto& candidate : candidates) {
+    if (config.allocator != "all" && config.allocator != candidate.name) {
+      continue;
+    }
+    if (pc && !candidate.supportsSharing) {
+      fprintf(stderr, "%s: skipped, cannot free across threads\n", candidate.name);
+      continue;
+    }
+    // the child's row goes through a pipe, so a run which crashes
+    // half-way leaves no partial row or dangling JSON separator
+    int fds[2];
+    if (pipe(fds) != 0) {
+      perror("pipe");
+      return EXIT_FAILURE;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      dup2(fds[1], STDOUT_FILENO);
+      close(fds[1]);
+      printResult(config, candidate.name, candidate.run(config));
+      fflush(stdout);
+      _exit(EXIT_SUCCESS);
+    }
+    close(fds[1]);
+    std::string row;
+    char buf[4096];
+    ssize_t got;
+    while ((got = read(fds[0], buf, sizeof(buf))) > 0 || (got < 0 && errno == EINTR)) {
+      row.append(buf, std::max<ssize_t>(got, 0));
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+      fprintf(stderr, "%s: run failed\n", candidate.name);
+      continue;
+    }
+    if (config.format == "json" && !first) {
+      printf(",\n");
+    }
+    first = false;
+    fwrite(row.data(), 1, row.size(), stdout);
+  }
+  if (config.format == "json") {
+    printf("\n]\n");
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,603 @@
+#include "chunk_chain.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <linux/mempolicy.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+static constexpr unsigned long long PAGE_PTR_MASK = (-1ll) ^ ((1 << 12) - 1);
+
+static const char str[] = "Got SIGSEGV, probably because of bad allocation at Allocator#";
+
+std::array<std::atomic<ChunkRegistry::Leaf*>, 1 << ChunkRegistry::ROOT_BITS> ChunkRegistry::root_{};
+
+static std::atomic<unsigned long long> chainSerial{0};
+
+static std::mutex idMutex;
+static std::vector<int> freeIds;
+static int nextId = 0;
+
+static char * itoa(int val, char *buf)
+{
+  int length = 0;
+  int _val = val;
+  do {
+    ++length;
+    _val /= 10;
+  } while (_val);
+  buf += length;
+  *buf = 0;
+  do {
+    --buf;
+    *buf = '0' + val % 10;
+    val /= 10;
+  } while (val);
+  return buf;
+}
+
+static void (*old_handler)(int, siginfo_t *, void *);
+
+static void handler(int signum, siginfo_t *si, void *p)
+{
+  char * aligned_ptr = (char *)((unsigned long long)si->si_addr & PAGE_PTR_MASK);
+  const Chunk* chunk = ChunkRegistry::find(aligned_ptr);
+  if (!chunk || chunk->base != aligned_ptr) {
+    old_handler(signum, si, p);
+  } else {
+    char buf[12];
+    const char *id_str = itoa(chunk->chain->id(), buf);
+    write(STDERR_FILENO, str, sizeof(str) - 1);
+    write(STDERR_FILENO, id_str, std::strlen(id_str));
+    write(STDERR_FILENO, "\n", 1);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void installGuardPageHandler() {
+  struct sigaction sa;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_sigaction = handler;
+
+  struct sigaction oa;
+  sigaction(SIGSEGV, &sa, &oa);
+  old_handler = oa.sa_sigaction;
+}
+
+bool hugePagesAvailable() {
+  static const bool available = [](){
+    FILE* fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (fp == NULL) {
+      return false;
+    }
+    char buf[64] = {};
+    bool read = fgets(buf, sizeof(buf), fp) != NULL;
+    fclose(fp);
+    return read && std::strstr(buf, "[never]") == NULL;
+  }();
+  return available;
+}
+
+void ChunkRegistry::insert(Chunk* chunk) {
+  for (uintptr_t granule = (uintptr_t)chunk->base >> GRANULE_BITS;
+       granule < ((uintptr_t)chunk->base + chunk->size) >> GRANULE_BITS; ++granule) {
+    std::atomic<Leaf*>& slot = root_[granule >> LEAF_BITS];
+    Leaf* leaf = slot.load(std::memory_order_acquire);
+    if (!leaf) {
+      void* mapped = mmap(NULL, sizeof(Leaf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mapped == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      // zero pages are null pointers, so the leaf needs no construction
+      Leaf* fresh = (Leaf*)mapped;
+      if (slot.compare_exchange_strong(leaf, fresh, std::memory_order_acq_rel)) {
+        leaf = fresh;
+      } else {
+        munmap(mapped, sizeof(Leaf));
+      }
+    }
+    (*leaf)[granule & ((1 << LEAF_BITS) - 1)].store(chunk, std::memory_order_release);
+  }
+}
+
+void ChunkRegistry::erase(const Chunk* chunk) {
+  for (uintptr_t granule = (uintptr_t)chunk->base >> GRANULE_BITS;
+       granule < ((uintptr_t)chunk->base + chunk->size) >> GRANULE_BITS; ++granule) {
+    Leaf* leaf = root_[granule >> LEAF_BITS].load(std::memory_order_relaxed);
+    (*leaf)[granule & ((1 << LEAF_BITS) - 1)].store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// populated at a time while growMutex_ is held, and locked at a time by the fallback
+static constexpr unsigned long long PREFAULT_SLICE = 64 * PAGE_SIZE;
+
+// faults in [from, to) for writing without changing its contents
+static void populate(char *from, char *to) {
+  if (from >= to || madvise(from, to - from, MADV_POPULATE_WRITE) == 0 || errno != EINVAL) {
+    return;
+  }
+  // kernels before 5.14: mlock faults in private writable pages for writing
+  // without touching them, so pages the pool already hands out are safe.
+  // In slices to stay below RLIMIT_MEMLOCK, past it the pages stay lazy.
+  for (char *slice = from; slice < to; slice += PREFAULT_SLICE) {
+    size_t length = std::min<unsigned long long>(PREFAULT_SLICE, to - slice);
+    if (mlock(slice, length) != 0) {
+      return;
+    }
+    munlock(slice, length);
+  }
+}
+
+int numaNodeCount() {
+  static const int count = [](){
+    FILE* fp = fopen("/sys/devices/system/node/online", "r");
+    if (fp == NULL) {
+      return 1;
+    }
+    // a list of ranges such as "0-1,3", nodes are counted up to the highest one
+    int highest = 0, node;
+    while (fscanf(fp, "%d", &node) == 1) {
+      highest = std::max(highest, node);
+      if (fgetc(fp) == EOF) {
+        break;
+      }
+    }
+    fclose(fp);
+    return highest + 1;
+  }();
+  return count;
+}
+
+// failures (no NUMA support, seccomp) leave the pages to the default policy
+static void bindToNode(char *base, unsigned long long size, int node) {
+  constexpr size_t maskBits = 8 * sizeof(unsigned long);
+  std::array<unsigned long, 16> mask{};
+  if (node < 0 || (size_t)node >= mask.size() * maskBits) {
+    return;
+  }
+  mask[node / maskBits] = 1ul << (node % maskBits);
+  syscall(SYS_mbind, base, size, MPOL_BIND, mask.data(), mask.size() * maskBits + 1, 0);
+}
+
+static char *mapAligned(unsigned long long size) {
+  char *raw = (char *) mmap(NULL, size + CHUNK_ALIGN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    throw std::bad_alloc();
+  }
+  char *aligned = (char *) roundUp((uintptr_t)raw, CHUNK_ALIGN);
+  if (aligned != raw) {
+    munmap(raw, aligned - raw);
+  }
+  munmap(aligned + size, raw + CHUNK_ALIGN - aligned);
+  return aligned;
+}
+
+void ChunkChain::push(unsigned long long size) {
+  char *base = mapAligned(size);
+  if (numaNode_ >= 0) {
+    bindToNode(base, size, numaNode_);
+  }
+  if (pageSize_ == PageSize::Huge && hugePagesAvailable()) {
+    madvise(base, size, MADV_HUGEPAGE);
+  } else if (pageSize_ == PageSize::Small) {
+    madvise(base, size, MADV_NOHUGEPAGE);
+  }
+  mprotect(base, PAGE_SIZE, PROT_NONE);
+  if (prefault_ == Prefault::Populate) {
+    populate(base + PAGE_SIZE, base + size);
+  }
+  Chunk* chunk = new Chunk{current_.load(std::memory_order_relaxed), this, base, base + PAGE_SIZE, size, {base + size}};
+  chunk->dirtyFrom = chunk->windowFloor = base + size;
+  chunk->since = std::chrono::steady_clock::now();
+  ChunkRegistry::insert(chunk);
+  current_.store(chunk, std::memory_order_release);
+  reserved_.fetch_add(size, std::memory_order_relaxed);
+  wakePrefaulter();
+}
+
+void ChunkChain::wakePrefaulter() {
+  if (prefault_ == Prefault::Background) {
+    prefaultEpoch_.fetch_add(1, std::memory_order_release);
+    prefaultEpoch_.notify_one();
+  }
+}
+
+/**
+ * Keeps prefaultWindow_ bytes below the top of the current chunk populated.
+ * Chunk fields are read and pages populated under growMutex_, so release()
+ * cannot unmap the chunk meanwhile. The lock is taken per PREFAULT_SLICE,
+ * so grow() and release() wait for one slice at most, and populating stops
+ * once the chunk is no longer current.
+ */
+void ChunkChain::prefaultLoop() {
+  const Chunk* chunk = nullptr;
+  char *touched = nullptr;
+  while (true) {
+    unsigned epoch = prefaultEpoch_.load(std::memory_order_acquire);
+    char *from, *to;
+    {
+      std::lock_guard lock{growMutex_};
+      if (prefaultStop_) {
+        return;
+      }
+      Chunk* current = current_.load(std::memory_order_relaxed);
+      char *end = current->base + current->size;
+      if (current != chunk) {
+        chunk = current;
+        touched = end;
+      }
+      char *top = std::clamp(current->top.load(std::memory_order_relaxed), current->limit, end);
+      to = std::min(touched, top);
+      from = to - current->limit > (long long)prefaultWindow_ ? to - prefaultWindow_ : current->limit;
+      touched = std::min(touched, from);
+      // wake up again when half of the window is used
+      char *mark = from == current->limit ? nullptr : from + prefaultWindow_ / 2;
+      current->prefaultMark.store(mark, std::memory_order_relaxed);
+    }
+    // top down, the pool reaches the upper pages first
+    for (char *slice = to; slice > from;) {
+      char *low = slice - std::min<unsigned long long>(PREFAULT_SLICE, slice - from);
+      std::lock_guard lock{growMutex_};
+      if (prefaultStop_ || current_.load(std::memory_order_relaxed) != chunk) {
+        break;
+      }
+      populate(low, slice);
+      slice = low;
+    }
+    prefaultEpoch_.wait(epoch, std::memory_order_acquire);
+  }
+}
+
+/**
+ * Runs with decay. Pools only trim their free lists on this thread when
+ * they were idle for a whole tick, so a busy pool keeps its free blocks.
+ */
+void ChunkChain::decayLoop() {
+  auto tick = std::max(decay_ / 2, std::chrono::milliseconds{1});
+  std::unique_lock lock{growMutex_};
+  while (!decayWake_.wait_for(lock, tick, [this] { return decayStop_; })) {
+    lock.unlock();
+    {
+      std::lock_guard trimLock{trimMutex_};
+      if (trimmer_) {
+        trimmer_(trimPool_);
+      }
+    }
+    lock.lock();
+    purgeExpired(std::chrono::steady_clock::now(), false);
+  }
+}
+
+ChunkChain::ChunkChain(const PoolOptions& options) {
+  {
+    std::lock_guard lock{idMutex};
+    if (freeIds.empty()) {
+      id_ = nextId++;
+    } else {
+      id_ = freeIds.back();
+      freeIds.pop_back();
+    }
+  }
+  serial_ = chainSerial.fetch_add(1, std::memory_order_relaxed) + 1;
+  nextSize_ = roundUp(options.chunkSize, CHUNK_ALIGN);
+  pageSize_ = options.pageSize;
+  // binding to the only node would just cost a syscall per chunk
+  numaNode_ = numaNodeCount() > 1 ? options.numaNode : -1;
+  prefault_ = options.prefault;
+  prefaultWindow_ = roundUp(options.prefaultWindow, PAGE_SIZE);
+  decay_ = std::chrono::milliseconds{std::max(-1ll, options.decayMs)};
+  purgeAdvice_ = options.purge == Purge::DontNeed ? MADV_DONTNEED : MADV_FREE;
+  push(nextSize_);
+  if (prefault_ == Prefault::Background) {
+    prefaulter_ = std::thread{&ChunkChain::prefaultLoop, this};
+  }
+  if (decay_.count() >= 0) {
+    decayer_ = std::thread{&ChunkChain::decayLoop, this};
+  }
+}
+
+ChunkChain::~ChunkChain() {
+  if (prefaulter_.joinable()) {
+    {
+      std::lock_guard lock{growMutex_};
+      prefaultStop_ = true;
+    }
+    wakePrefaulter();
+    prefaulter_.join();
+  }
+  if (decayer_.joinable()) {
+    {
+      std::lock_guard lock{growMutex_};
+      decayStop_ = true;
+    }
+    decayWake_.notify_one();
+    decayer_.join();
+  }
+  Chunk* chunk = current_.load(std::memory_order_relaxed);
+  while (chunk) {
+    ChunkRegistry::erase(chunk);
+    munmap(chunk->base, chunk->size);
+    delete std::exchange(chunk, chunk->prev);
+  }
+  while (retained_) {
+    munmap(retained_->base, retained_->size);
+    delete std::exchange(retained_, retained_->prev);
+  }
+  std::lock_guard lock{idMutex};
+  freeIds.push_back(id_);
+}
+
+// reuses a retained chunk with room for bytes
+bool ChunkChain::reuse(unsigned long long bytes) {
+  for (Chunk** link = &retained_; *link; link = &(*link)->prev) {
+    Chunk* chunk = *link;
+    if (chunk->size - PAGE_SIZE < bytes) {
+      continue;
+    }
+    *link = chunk->prev;
+    char *end = chunk->base + chunk->size;
+    chunk->prev = current_.load(std::memory_order_relaxed);
+    chunk->top.store(end, std::memory_order_relaxed);
+    chunk->prefaultMark.store(nullptr, std::memory_order_relaxed);
+    chunk->windowFloor = end;
+    chunk->since = std::chrono::steady_clock::now();
+    retainedBytes_.fetch_sub(chunk->size, std::memory_order_relaxed);
+    ChunkRegistry::insert(chunk);
+    current_.store(chunk, std::memory_order_release);
+    wakePrefaulter();
+    return true;
+  }
+  return false;
+}
+
+Chunk* ChunkChain::grow(Chunk* seen, unsigned long long bytes) {
+  std::lock_guard lock{growMutex_};
+  if (current_.load(std::memory_order_relaxed) == seen && !reuse(bytes)) {
+    nextSize_ = std::min(nextSize_ * 2, MAX_CHUNK_SIZE);
+    push(std::max(nextSize_, roundUp(bytes + PAGE_SIZE, CHUNK_ALIGN)));
+  }
+  if (decay_.count() >= 0) {
+    purgeExpired(std::chrono::steady_clock::now(), false);
+  }
+  return current_.load(std::memory_order_relaxed);
+}
+
+static char *clampedTop(const Chunk* chunk) {
+  return std::clamp(chunk->top.load(std::memory_order_relaxed), chunk->limit, chunk->base + chunk->size);
+}
+
+/**
+ * Without decay the dropped chunks are unmapped. With decay they are kept
+ * for grow(), and keep tracks how deep the pool went in it: pages below
+ * the lowest top of a whole decay window were not needed in that window
+ * and are purged, here or by purgeRewound().
+ */
+void ChunkChain::release(Chunk* keep, char* top) {
+  std::lock_guard lock{growMutex_};
+  auto now = std::chrono::steady_clock::now();
+  highWater_.store(highWaterBytes(), std::memory_order_relaxed);
+  Chunk* chunk = current_.load(std::memory_order_relaxed);
+  while (chunk != keep) {
+    Chunk* prev = chunk->prev;
+    ChunkRegistry::erase(chunk);
+    if (decay_.count() < 0) {
+      reserved_.fetch_sub(chunk->size, std::memory_order_relaxed);
+      munmap(chunk->base, chunk->size);
+      delete chunk;
+    } else {
+      chunk->dirtyFrom = std::min(chunk->dirtyFrom, clampedTop(chunk));
+      chunk->since = now;
+      chunk->prev = std::exchange(retained_, chunk);
+      retainedBytes_.fetch_add(chunk->size, std::memory_order_relaxed);
+    }
+    chunk = prev;
+  }
+  if (decay_.count() >= 0) {
+    char *low = clampedTop(keep);
+    keep->dirtyFrom = std::min(keep->dirtyFrom, low);
+    keep->windowFloor = std::min(keep->windowFloor, low);
+  }
+  // free blocks in dropped chunks or below the new top are carved again,
+  // a block freed before the mark may have merged with one carved after it
+  for (auto span = spans_.begin(); span != spans_.end();) {
+    Chunk* owner = ChunkRegistry::find(span->first);
+    if (owner && owner->chain == this && (owner != keep || span->first >= top)) {
+      ++span;
+      continue;
+    }
+    char* end = span->first + span->second.size;
+    FreeSpan rest = span->second;
+    span = eraseSpan(span);
+    if (owner == keep && end > top) {
+      rest.size = end - top;
+      rest.cut(top);
+      insertSpan(top, rest);
+    }
+  }
+  keep->top.store(top, std::memory_order_relaxed);
+  current_.store(keep, std::memory_order_release);
+  if (decay_.count() >= 0) {
+    purgeCurrent(now, false);
+    purgeExpired(now, false);
+  }
+  wakePrefaulter();
+}
+
+/**
+ * Pages between dirtyFrom and the bump pointer are free, but a pool may
+ * bump into them any time. So they are claimed first: top moves down to
+ * them with a CAS, a thread bumping meanwhile gets fresh memory below.
+ * Top goes back up after the purge if nobody did, else the claimed range
+ * becomes a free span. A pool which moves top with plain stores must not
+ * bump meanwhile: the owner of a MemPool never does, Mutexed holds m_.
+ */
+void ChunkChain::purgeCurrent(std::chrono::steady_clock::time_point now, bool all) {
+  Chunk* chunk = current_.load(std::memory_order_relaxed);
+  if (!all && now - chunk->since < decay_) {
+    return;
+  }
+  char* from = (char*)((uintptr_t)chunk->dirtyFrom & ~(PAGE_SIZE - 1));
+  char* top = chunk->top.load(std::memory_order_relaxed);
+  char* to;
+  do {
+    char* free = std::clamp(top, chunk->limit, chunk->base + chunk->size);
+    to = (char*)((uintptr_t)(all ? free : std::min(chunk->windowFloor, free)) & ~(PAGE_SIZE - 1));
+    if (to <= from) {
+      chunk->windowFloor = free;
+      chunk->since = now;
+      return;
+    }
+  } while (!chunk->top.compare_exchange_weak(top, from, std::memory_order_relaxed));
+  purgePages(from, to);
+  char* claimed = from;
+  if (!chunk->top.compare_exchange_strong(claimed, top, std::memory_order_relaxed)) {
+    insertSpan(from, FreeSpan{(unsigned long long)(top - from), now, to, top});
+  }
+  chunk->dirtyFrom = to;
+  chunk->windowFloor = clampedTop(chunk);
+  chunk->since = now;
+}
+
+void ChunkChain::purgeRewound() {
+  if (decay_.count() < 0) {
+    return;
+  }
+  std::lock_guard lock{growMutex_};
+  purgeCurrent(std::chrono::steady_clock::now(), false);
+}
+
+// purges the whole pages of [from, to)
+void ChunkChain::purgePages(char* from, char* to) {
+  from = (char*)((uintptr_t)from & ~(PAGE_SIZE - 1));
+  to = (char*)((uintptr_t)to & ~(PAGE_SIZE - 1));
+  if (from < to) {
+    madvise(from, to - from, purgeAdvice_);
+    purged_.fetch_add(to - from, std::memory_order_relaxed);
+  }
+}
+
+// with all set everything is purged regardless of its age, growMutex_ is held
+void ChunkChain::purgeExpired(std::chrono::steady_clock::time_point now, bool all) {
+  for (Chunk** link = &retained_; *link;) {
+    Chunk* chunk = *link;
+    if (!all && now - chunk->since < decay_) {
+      link = &chunk->prev;
+      continue;
+    }
+    // the dirty pages count as purged, unmapping hands them back too
+    char *end = chunk->base + chunk->size;
+    purged_.fetch_add(end - std::max(chunk->dirtyFrom, chunk->limit), std::memory_order_relaxed);
+    reserved_.fetch_sub(chunk->size, std::memory_order_relaxed);
+    retainedBytes_.fetch_sub(chunk->size, std::memory_order_relaxed);
+    *link = chunk->prev;
+    munmap(chunk->base, chunk->size);
+    delete chunk;
+  }
+  for (auto& [p, span] : spans_) {
+    if (span.dirtyFrom < span.dirtyTo && (all || now - span.since >= decay_)) {
+      // pages of the span only, the first and last may be shared with live blocks
+      char* from = (char*)((uintptr_t)span.dirtyFrom & ~(PAGE_SIZE - 1));
+      char* to = (char*)roundUp((uintptr_t)span.dirtyTo, PAGE_SIZE);
+      purgePages(std::max(from, (char*)roundUp((uintptr_t)p, PAGE_SIZE)), std::min(to, p + span.size));
+      span.dirtyFrom = span.dirtyTo = p;
+    }
+  }
+}
+
+void ChunkChain::insertSpan(char* p, const FreeSpan& span) {
+  spans_.emplace(p, span);
+  spansBySize_.emplace(span.size, p);
+  largestSpan_.store(spansBySize_.rbegin()->first, std::memory_order_relaxed);
+}
+
+std::map<char*, ChunkChain::FreeSpan>::iterator ChunkChain::eraseSpan(std::map<char*, FreeSpan>::iterator span) {
+  spansBySize_.erase({span->second.size, span->first});
+  largestSpan_.store(spansBySize_.empty() ? 0 : spansBySize_.rbegin()->first, std::memory_order_relaxed);
+  return spans_.erase(span);
+}
+
+char* ChunkChain::takeBlocksSlow(unsigned long long bytes, unsigned long long& count) {
+  std::lock_guard lock{growMutex_};
+  auto fit = spansBySize_.lower_bound({bytes, nullptr});
+  if (fit == spansBySize_.end()) {
+    return nullptr;
+  }
+  char* p = fit->second;
+  auto span = spans_.find(p);
+  FreeSpan rest = span->second;
+  eraseSpan(span);
+  count = std::min(count, rest.size / bytes);
+  if (rest.size > count * bytes) {
+    rest.size -= count * bytes;
+    rest.cut(p + count * bytes);
+    insertSpan(p + count * bytes, rest);
+  }
+  return p;
+}
+
+/**
+ * Blocks of different chunks are never adjacent: every chunk starts with
+ * its guard page. The dirty part of a merged span spans those of its
+ * pieces, so a purged page between two dirty ones is purged once more.
+ */
+void ChunkChain::freeLarge(void* block, unsigned long long bytes) {
+  char* p = (char*)block;
+  std::lock_guard lock{growMutex_};
+  auto now = std::chrono::steady_clock::now();
+  FreeSpan merged{bytes, now, p, p + bytes};
+  auto next = spans_.lower_bound(p);
+  if (next != spans_.end() && next->first == p + bytes) {
+    merged.size += next->second.size;
+    merged.dirtyTo = std::max(merged.dirtyTo, next->second.dirtyTo);
+    next = eraseSpan(next);
+  }
+  if (next != spans_.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second.size == p) {
+      p = prev->first;
+      merged.size += prev->second.size;
+      if (prev->second.dirtyFrom < prev->second.dirtyTo) {
+        merged.dirtyFrom = prev->second.dirtyFrom;
+      }
+      eraseSpan(prev);
+    }
+  }
+  insertSpan(p, merged);
+}
+
+void ChunkChain::purge() {
+  if (decay_.count() < 0) {
+    return;
+  }
+  std::lock_guard lock{growMutex_};
+  auto now = std::chrono::steady_clock::now();
+  purgeCurrent(now, true);
+  purgeExpired(now, true);
+}
+
+unsigned long long ChunkChain::carvedBytes() const {
+  unsigned long long carved = 0;
+  for (Chunk* chunk = current_.load(std::memory_order_acquire); chunk; chunk = chunk->prev) {
+    uintptr_t end = (uintptr_t)chunk->base + chunk->size;
+    uintptr_t top = std::clamp((uintptr_t)chunk->top.load(std::memory_order_relaxed), (uintptr_t)chunk->limit, end);
+    carved += end - top;
+  }
+  return carved;
+}
+
+unsigned long long ChunkChain::highWaterBytes() const {
+  return std::max(highWater_.load(std::memory_order_relaxed), carvedBytes());
+}
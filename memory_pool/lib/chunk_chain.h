@@ -0,0 +1,354 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+
+static constexpr size_t PAGE_SIZE = 1 << 12;
+
+static constexpr size_t HUGE_PAGE_SIZE = 512 * PAGE_SIZE;
+static constexpr size_t CHUNK_ALIGN = HUGE_PAGE_SIZE;
+static constexpr unsigned long long DEFAULT_CHUNK_SIZE = 4096ull * PAGE_SIZE;
+static constexpr unsigned long long MAX_CHUNK_SIZE = 256ull * 1024 * PAGE_SIZE;
+static constexpr unsigned long long DEFAULT_PREFAULT_WINDOW = 2048ull * PAGE_SIZE;
+
+static constexpr unsigned long long roundUp(unsigned long long size, unsigned long long align) {
+  return (size + align - 1) / align * align;
+}
+
+enum class PageSize {
+  System,  // whatever the kernel THP setting gives
+  Huge,    // madvise(MADV_HUGEPAGE), plain pages if THP is unavailable
+  Small,   // madvise(MADV_NOHUGEPAGE)
+};
+
+enum class Prefault {
+  Lazy,        // pages fault in on first touch by the allocating thread
+  Populate,    // every chunk is populated when it is mapped
+  Background,  // a helper thread populates prefaultWindow bytes below the bump pointer
+};
+
+enum class Purge {
+  Free,      // madvise(MADV_FREE), the kernel takes the pages under memory pressure
+  DontNeed,  // madvise(MADV_DONTNEED), RSS drops at once
+};
+
+struct PoolOptions {
+  unsigned long long chunkSize = DEFAULT_CHUNK_SIZE;
+  PageSize pageSize = PageSize::System;
+  Prefault prefault = Prefault::Lazy;
+  unsigned long long prefaultWindow = DEFAULT_PREFAULT_WINDOW;
+  // unused pages are purged after being idle that long, -1 keeps them
+  long long decayMs = -1;
+  Purge purge = Purge::Free;
+  // chunks are bound to this NUMA node with mbind, -1 leaves them to the kernel
+  int numaNode = -1;
+};
+
+bool hugePagesAvailable();
+
+// 1 on machines without NUMA
+int numaNodeCount();
+
+/**
+ * Installs a SIGSEGV handler which reports faults on the guard page of any
+ * live pool chunk and passes all other faults to the previous handler.
+ */
+void installGuardPageHandler();
+
+class ChunkChain;
+
+/**
+ * One mmap'd piece of a pool. The lowest page is a PROT_NONE guard page,
+ * the bump pointer top moves from the end of the mapping down to limit.
+ */
+struct Chunk {
+  Chunk* prev;
+  ChunkChain* chain;
+  char *base, *limit;
+  unsigned long long size;
+  std::atomic<char*> top;
+  // with Prefault::Background the helper is woken once top drops below it
+  std::atomic<char*> prefaultMark{nullptr};
+  // decay bookkeeping, guarded by the grow mutex of the chain:
+  // pages in [dirtyFrom, top) were carved once and are free again,
+  // windowFloor is the lowest top since the decay window started at since
+  char *dirtyFrom = nullptr, *windowFloor = nullptr;
+  std::chrono::steady_clock::time_point since{};
+};
+
+/**
+ * Maps every live chunk to the CHUNK_ALIGN-sized granules it covers: a
+ * two-level radix tree over the 48-bit user address space. The root is a
+ * static array, leaves are mmap'd on first use and never freed.
+ * find() takes two loads and no locks, so it may run in a signal handler;
+ * insert() and erase() are only called by the ChunkChain owning the chunk.
+ */
+class ChunkRegistry {
+public:
+  static constexpr unsigned ADDRESS_BITS = 48;
+  static constexpr unsigned GRANULE_BITS = 21;
+  static constexpr unsigned LEAF_BITS = 14;
+  static constexpr unsigned ROOT_BITS = ADDRESS_BITS - GRANULE_BITS - LEAF_BITS;
+
+  using Leaf = std::array<std::atomic<Chunk*>, 1 << LEAF_BITS>;
+
+  // chunk must be CHUNK_ALIGN-aligned and a multiple of CHUNK_ALIGN long
+  static void insert(Chunk* chunk);
+  static void erase(const Chunk* chunk);
+
+  // the live chunk containing p or nullptr
+  static Chunk* find(const void* p) {
+    uintptr_t granule = (uintptr_t)p >> GRANULE_BITS;
+    if (granule >> (ROOT_BITS + LEAF_BITS)) {
+      return nullptr;
+    }
+    Leaf* leaf = root_[granule >> LEAF_BITS].load(std::memory_order_acquire);
+    if (!leaf) {
+      return nullptr;
+    }
+    return (*leaf)[granule & ((1 << LEAF_BITS) - 1)].load(std::memory_order_acquire);
+  }
+
+private:
+  static std::array<std::atomic<Leaf*>, 1 << ROOT_BITS> root_;
+};
+
+static_assert(CHUNK_ALIGN == 1ull << ChunkRegistry::GRANULE_BITS, "registry granules must match chunk alignment");
+
+// Frees a block of bytes, rounded by roundToBlock, to pool
+using BlockDeallocator = void (*)(void* pool, void* p, size_t bytes);
+
+// Hands whole free pages of pool's free lists back to its chain and purges
+// the pages release() rewound, see ChunkChain::setTrimmer
+using PoolTrimmer = void (*)(void* pool);
+
+/**
+ * Chunks of one pool, newest first. A pool maps a single chunk of
+ * PoolOptions::chunkSize up front and calls grow() when the current one is
+ * exhausted; every next chunk is twice as large up to MAX_CHUNK_SIZE, so
+ * address space is reserved in proportion to the actual load.
+ * Chunks are aligned to huge pages, so with PageSize::Huge everything but
+ * the first huge page of a chunk (split by the guard page) can be backed
+ * by transparent huge pages.
+ * Chunks are registered in ChunkRegistry, so that a fault on the guard page
+ * of any of them is reported with the chain id, and a block freed to the
+ * wrong pool can be forwarded to the pool it came from.
+ * Ids are dense and reused after a chain is destroyed, serials are not.
+ * With Prefault::Background the chain runs a helper thread which populates
+ * pages ahead of the bump pointer, so that allocating threads rarely take a
+ * page fault; pools report their progress through bumped().
+ * Blocks larger than the pools' size classes are recycled here: freed
+ * ones are merged with free neighbours and handed out again best fit.
+ * With PoolOptions::decayMs >= 0 memory the pool no longer uses goes back
+ * to the OS once it has been unused for decayMs: chunks dropped by
+ * release() are kept for reuse by grow() and then unmapped, pages rewound
+ * by release() and free large blocks are purged with madvise, and so are
+ * whole pages of free small blocks which the pool trims off its free
+ * lists. A helper thread does this every decayMs / 2, so it needs no
+ * allocator traffic; grow() and release() also purge what has expired.
+ */
+class ChunkChain {
+private:
+  std::atomic<Chunk*> current_{nullptr};
+  std::mutex growMutex_;
+  unsigned long long nextSize_;
+  PageSize pageSize_;
+  int numaNode_;
+  int id_;
+  unsigned long long serial_;
+  void* pool_ = nullptr;
+  BlockDeallocator deallocator_ = nullptr;
+  std::atomic<unsigned long long> reserved_{0};
+  std::atomic<unsigned long long> highWater_{0};
+  Prefault prefault_;
+  unsigned long long prefaultWindow_;
+  std::atomic<unsigned> prefaultEpoch_{0};
+  bool prefaultStop_ = false;
+  std::thread prefaulter_;
+  std::chrono::milliseconds decay_;
+  int purgeAdvice_;
+  Chunk* retained_ = nullptr;
+  // free large blocks by address, for merging, and by size, for best fit;
+  // [dirtyFrom, dirtyTo) covers the parts not purged yet, freed since
+  struct FreeSpan {
+    unsigned long long size;
+    std::chrono::steady_clock::time_point since;
+    char *dirtyFrom, *dirtyTo;
+
+    // keeps the dirty part from start on
+    void cut(char* start) {
+      dirtyFrom = std::max(dirtyFrom, start);
+      dirtyTo = std::max(dirtyTo, dirtyFrom);
+    }
+  };
+  std::map<char*, FreeSpan> spans_;
+  std::set<std::pair<unsigned long long, char*>> spansBySize_;
+  // size of the largest of spans_, lets takeBlocks() skip the lock when nothing fits
+  std::atomic<unsigned long long> largestSpan_{0};
+  bool decayStop_ = false;
+  std::condition_variable decayWake_;
+  std::thread decayer_;
+  // guards the trimmer, which takes the pool's locks and then growMutex_
+  std::mutex trimMutex_;
+  void* trimPool_ = nullptr;
+  PoolTrimmer trimmer_ = nullptr;
+  std::atomic<unsigned long long> retainedBytes_{0};
+  std::atomic<unsigned long long> purged_{0};
+
+  void push(unsigned long long size);
+  bool reuse(unsigned long long bytes);
+  void wakePrefaulter();
+  void prefaultLoop();
+  void decayLoop();
+  void purgePages(char* from, char* to);
+  void purgeExpired(std::chrono::steady_clock::time_point now, bool all);
+  void purgeCurrent(std::chrono::steady_clock::time_point now, bool all);
+  void insertSpan(char* p, const FreeSpan& span);
+  char* takeBlocksSlow(unsigned long long bytes, unsigned long long& count);
+  std::map<char*, FreeSpan>::iterator eraseSpan(std::map<char*, FreeSpan>::iterator span);
+
+public:
+  explicit ChunkChain(const PoolOptions& options);
+  ~ChunkChain();
+
+  ChunkChain(const ChunkChain&) = delete;
+  ChunkChain& operator=(const ChunkChain&) = delete;
+
+  int id() const {
+    return id_;
+  }
+
+  // unlike id, never reused by another chain
+  unsigned long long serial() const {
+    return serial_;
+  }
+
+  Chunk* current() const {
+    return current_.load(std::memory_order_acquire);
+  }
+
+  /**
+   * Called by the allocating thread which found exhausted chunk seen.
+   * Maps a chunk with at least bytes of free space unless another thread
+   * already did so, and returns the new current chunk.
+   */
+  Chunk* grow(Chunk* seen, unsigned long long bytes);
+
+  // called by pools after moving the top of chunk down to p
+  void bumped(Chunk* chunk, const char* p) {
+    if (p < chunk->prefaultMark.load(std::memory_order_relaxed)) [[unlikely]] {
+      // the helper sets a new mark, until then nobody has to wake it again
+      chunk->prefaultMark.store(nullptr, std::memory_order_relaxed);
+      wakePrefaulter();
+    }
+  }
+
+  // drops all chunks newer than keep and rewinds keep to top
+  void release(Chunk* keep, char* top);
+
+  /**
+   * Splits up to count adjacent blocks of bytes off the start of the
+   * smallest free large block which holds one, stores how many in count
+   * and returns the first, or nullptr.
+   */
+  char* takeBlocks(unsigned long long bytes, unsigned long long& count) {
+    if (!mayTake(bytes)) [[likely]] {
+      return nullptr;
+    }
+    return takeBlocksSlow(bytes, count);
+  }
+
+  // false if takeBlocks() surely finds no block of bytes
+  bool mayTake(unsigned long long bytes) const {
+    return largestSpan_.load(std::memory_order_relaxed) >= bytes;
+  }
+
+  char* takeLarge(unsigned long long bytes) {
+    unsigned long long count = 1;
+    return takeBlocks(bytes, count);
+  }
+
+  /**
+   * Called by pools for a freed block larger than their size classes, the
+   * unused tail of one or a run of free small blocks they trimmed. With
+   * decay its whole pages are purged once it has been free for decayMs.
+   */
+  void freeLarge(void* p, unsigned long long bytes);
+
+  /**
+   * Unmaps retained chunks and purges free large blocks and the free pages
+   * of the current chunk at once, no matter how long they are idle. Pools
+   * which bump with plain stores call it where top cannot move.
+   */
+  void purge();
+
+  /**
+   * Purges the pages release() rewound in the current chunk once the pool
+   * did not reach them for decayMs. Safe while the pool bumps by fetch_sub,
+   * pools which bump with plain stores call it where top cannot move.
+   */
+  void purgeRewound();
+
+  bool decays() const {
+    return decay_.count() >= 0;
+  }
+
+  /**
+   * With decay, trimmer is called with pool from the helper thread every
+   * decayMs / 2; the pool resets it to nullptr before it is destroyed.
+   */
+  void setTrimmer(void* pool, PoolTrimmer trimmer) {
+    std::lock_guard lock{trimMutex_};
+    trimPool_ = pool;
+    trimmer_ = trimmer;
+  }
+
+  // called once by the owning pool, enables forward()
+  void setDeallocator(void* pool, BlockDeallocator deallocator) {
+    pool_ = pool;
+    deallocator_ = deallocator;
+  }
+
+  /**
+   * Hands p to the pool which allocated it and returns true if that is not
+   * the pool of this chain. Allocators compare equal like std::allocator,
+   * so containers may free a block through any pool.
+   */
+  bool forward(void* p, size_t bytes) const {
+    Chunk* chunk = ChunkRegistry::find(p);
+    if (!chunk || chunk->chain == this) [[likely]] {
+      return false;
+    }
+    ChunkChain* owner = chunk->chain;
+    owner->deallocator_(owner->pool_, p, bytes);
+    return true;
+  }
+
+  unsigned long long reservedBytes() const {
+    return reserved_.load(std::memory_order_relaxed);
+  }
+
+  // bytes below the chunk tops, i.e. handed out by the bump pointer
+  unsigned long long carvedBytes() const;
+
+  // peak of carvedBytes, which only goes down on release
+  unsigned long long highWaterBytes() const;
+
+  // part of reservedBytes in chunks kept for reuse
+  unsigned long long retainedBytes() const {
+    return retainedBytes_.load(std::memory_order_relaxed);
+  }
+
+  unsigned long long purgedBytes() const {
+    return purged_.load(std::memory_order_relaxed);
+  }
+};
@@ -0,0 +1,1047 @@
+#pragma once
+#include "chunk_chain.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Every allocation is rounded up to a block size: a multiple of
+ * BLOCK_ALIGN up to MAX_SMALL_SIZE, then MEDIUM_STEPS sizes per doubling up
+ * to MAX_CLASS_SIZE, so that at most a fifth of a block is padding. Blocks
+ * up to MAX_CLASS_SIZE are recycled through one free list per size class.
+ * Larger blocks are whole pages and are recycled by the chunk chain, see
+ * ChunkChain::takeLarge.
+ */
+static constexpr size_t BLOCK_ALIGN = 16;
+static constexpr size_t SMALL_CLASSES = 16;
+static constexpr size_t MAX_SMALL_SIZE = SMALL_CLASSES * BLOCK_ALIGN;
+static constexpr size_t MEDIUM_STEPS = 4;
+static constexpr size_t MAX_CLASS_SIZE = 64 * MAX_SMALL_SIZE;
+static constexpr size_t SIZE_CLASSES =
+    SMALL_CLASSES + MEDIUM_STEPS * (std::bit_width(MAX_CLASS_SIZE) - std::bit_width(MAX_SMALL_SIZE));
+
+static constexpr size_t roundToBlock(size_t size) {
+  size = std::max<size_t>(size, 1);
+  if (size <= MAX_SMALL_SIZE) [[likely]] {
+    return (size + BLOCK_ALIGN - 1) & ~(BLOCK_ALIGN - 1);
+  }
+  if (size <= MAX_CLASS_SIZE) {
+    // sizes in (2^k, 2^(k+1)] go up in steps of 2^k / MEDIUM_STEPS
+    size_t step = std::bit_floor(size - 1) / MEDIUM_STEPS;
+    return (size + step - 1) & ~(step - 1);
+  }
+  return roundUp(size, PAGE_SIZE);
+}
+
+// blockSize as returned by roundToBlock, up to MAX_CLASS_SIZE
+static constexpr size_t sizeClass(size_t blockSize) {
+  if (blockSize <= MAX_SMALL_SIZE) [[likely]] {
+    return blockSize / BLOCK_ALIGN - 1;
+  }
+  size_t log = std::bit_width(blockSize - 1) - 1;
+  size_t step = ((size_t)1 << log) / MEDIUM_STEPS;
+  return SMALL_CLASSES + (log + 1 - std::bit_width(MAX_SMALL_SIZE)) * MEDIUM_STEPS
+      + (blockSize - ((size_t)1 << log)) / step - 1;
+}
+
+// the block size of a size class, the inverse of sizeClass
+static constexpr size_t classSize(size_t cls) {
+  if (cls < SMALL_CLASSES) [[likely]] {
+    return (cls + 1) * BLOCK_ALIGN;
+  }
+  size_t base = MAX_SMALL_SIZE << (cls - SMALL_CLASSES) / MEDIUM_STEPS;
+  return base + ((cls - SMALL_CLASSES) % MEDIUM_STEPS + 1) * (base / MEDIUM_STEPS);
+}
+
+static_assert(sizeClass(roundToBlock(MAX_SMALL_SIZE + 1)) == SMALL_CLASSES, "medium classes follow the small ones");
+static_assert(sizeClass(MAX_CLASS_SIZE) == SIZE_CLASSES - 1, "the largest block has the last class");
+
+struct FreeBlock {
+  FreeBlock* next;
+};
+
+using FreeLists = std::array<FreeBlock*, SIZE_CLASSES>;
+
+/**
+ * Treiber stack of free blocks. The upper 16 bits of head hold
+ * a modification counter so that a pop racing with pop+push of the same
+ * block (ABA) fails its CAS. Blocks stay mapped while the pool lives, so
+ * reading next of an already popped block is harmless; it is read and
+ * linked atomically since trimming relinks popped blocks concurrently.
+ */
+class alignas(64) AtomicFreeList {
+private:
+  static constexpr int TAG_SHIFT = 48;
+  static constexpr uint64_t PTR_MASK = (1ull << TAG_SHIFT) - 1;
+  std::atomic<uint64_t> head{0};
+
+  static uint64_t nextTag(uint64_t old) {
+    return ((old >> TAG_SHIFT) + 1) << TAG_SHIFT;
+  }
+
+public:
+  static void link(FreeBlock* block, FreeBlock* next) {
+    std::atomic_ref(block->next).store(next, std::memory_order_relaxed);
+  }
+
+  // pushes the blocks from first to last, linked through next
+  void push(FreeBlock* first, FreeBlock* last) {
+    uint64_t old = head.load(std::memory_order_relaxed);
+    do {
+      link(last, (FreeBlock*)(old & PTR_MASK));
+    } while (!head.compare_exchange_weak(old, (uint64_t)first | nextTag(old),
+                                         std::memory_order_release, std::memory_order_relaxed));
+  }
+
+  void push(FreeBlock* block) {
+    push(block, block);
+  }
+
+  // empties the list and returns its blocks
+  FreeBlock* popAll() {
+    uint64_t old = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(old, nextTag(old), std::memory_order_acquire, std::memory_order_relaxed)) {}
+    return (FreeBlock*)(old & PTR_MASK);
+  }
+
+  void clear() {
+    head.store(0, std::memory_order_relaxed);
+  }
+
+  FreeBlock* pop() {
+    uint64_t old = head.load(std::memory_order_acquire);
+    while (old & PTR_MASK) {
+      FreeBlock* block = (FreeBlock*)(old & PTR_MASK);
+      FreeBlock* next = std::atomic_ref(block->next).load(std::memory_order_relaxed);
+      if (head.compare_exchange_weak(old, (uint64_t)next | nextTag(old),
+                                     std::memory_order_acquire, std::memory_order_acquire)) {
+        return block;
+      }
+    }
+    return nullptr;
+  }
+};
+
+using ClassedBlocks = std::vector<std::pair<char*, size_t>>;
+
+/**
+ * Takes blocks, free blocks with their size class, apart for decay: every
+ * run of adjacent ones which covers a whole page goes to chain, which
+ * purges it after decayMs and recycles it, see takeRecycled. Only the
+ * other blocks are left, in address order.
+ */
+static inline void trimBlocks(ClassedBlocks& blocks, ChunkChain& chain) {
+  // plain pointers, a pool may hold millions of free blocks
+  auto *begin = blocks.data(), *end = begin + blocks.size();
+  std::sort(begin, end);
+  auto* kept = begin;
+  for (auto *first = begin, *last = first; first != end; first = last) {
+    char* runEnd = first->first;
+    for (; last != end && last->first == runEnd; ++last) {
+      runEnd += classSize(last->second);
+    }
+    if (roundUp((uintptr_t)first->first, PAGE_SIZE) + PAGE_SIZE <= (uintptr_t)runEnd) {
+      chain.freeLarge(first->first, runEnd - first->first);
+    } else {
+      kept = std::move(first, last, kept);
+    }
+  }
+  blocks.resize(kept - begin);
+}
+
+static inline void trimFreeLists(FreeLists& lists, ChunkChain& chain) {
+  ClassedBlocks blocks;
+  for (size_t cls = 0; cls < SIZE_CLASSES; ++cls) {
+    for (FreeBlock* block = lists[cls]; block; block = block->next) {
+      blocks.emplace_back((char*)block, cls);
+    }
+  }
+  trimBlocks(blocks, chain);
+  lists = {};
+  for (auto block = blocks.rbegin(); block != blocks.rend(); ++block) {
+    FreeBlock*& head = lists[block->second];
+    head = new (block->first) FreeBlock{head};
+  }
+}
+
+/**
+ * Takes a page worth of blocks of bytes from the free large blocks of chain,
+ * where trimmed pages end up, and returns the first one. The others are
+ * linked from first to last, both are nullptr if there are none. Pools
+ * call it once their chunk is used up, before they grow.
+ */
+static inline char* takeRecycled(ChunkChain& chain, size_t bytes, FreeBlock*& first, FreeBlock*& last) {
+  if (!chain.mayTake(bytes)) [[likely]] {
+    return nullptr;
+  }
+  unsigned long long count = std::max<size_t>(PAGE_SIZE / bytes, 1);
+  char* block = chain.takeBlocks(bytes, count);
+  if (!block) {
+    return nullptr;
+  }
+  first = last = nullptr;
+  for (unsigned long long i = count - 1; i > 0; --i) {
+    first = new (block + i * bytes) FreeBlock{first};
+    last = last ? last : first;
+  }
+  return block;
+}
+
+/**
+ * Position of a pool's bump pointer saved by mark(). release() rewinds the
+ * pool to it in O(1): chunks mapped after the mark are unmapped and the
+ * free lists are emptied, so blocks freed before the mark are not reused
+ * until the pool is destroyed.
+ */
+struct PoolMark {
+  Chunk* chunk;
+  char* top;
+};
+
+template<typename T>
+concept ScopedArena = requires(T& alloc, const PoolMark& mark) {
+  { alloc.mark() } -> std::same_as<PoolMark>;
+  alloc.release(mark);
+  { alloc.inScope() } -> std::same_as<bool>;
+};
+
+/**
+ * Marks the pool on construction and releases everything allocated since
+ * then on destruction. Containers of trivially destructible elements built
+ * inside the scope may skip their destroy walk, see List in test.cpp.
+ */
+template <ScopedArena Allocator>
+class ArenaScope {
+private:
+  Allocator& alloc_;
+  PoolMark mark_;
+
+public:
+  explicit ArenaScope(Allocator& alloc) : alloc_(alloc), mark_(alloc.mark()) {}
+
+  ~ArenaScope() {
+    alloc_.release(mark_);
+  }
+
+  ArenaScope(const ArenaScope&) = delete;
+  ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+/**
+ * Snapshot of a pool returned by stats(). Counters are kept per thread and
+ * only summed here, so the figures of concurrently running threads may be
+ * slightly out of date relative to each other.
+ */
+struct PoolStats {
+  unsigned long long reservedBytes = 0;   // mapped by the pool's chunks
+  unsigned long long carvedBytes = 0;     // handed out by the bump pointer
+  unsigned long long highWaterBytes = 0;  // peak of carvedBytes
+  unsigned long long usedBytes = 0;       // allocated and not freed yet
+  unsigned long long allocations = 0;
+  unsigned long long deallocations = 0;
+  unsigned long long lockWaitNs = 0;      // MutexedMemPoolAllocator only
+  unsigned long long retainedBytes = 0;   // part of reservedBytes kept for reuse
+  unsigned long long purgedBytes = 0;     // returned to the OS by decay so far
+
+  // sums up the stats of several pools
+  PoolStats& operator+=(const PoolStats& other) {
+    reservedBytes += other.reservedBytes;
+    carvedBytes += other.carvedBytes;
+    highWaterBytes += other.highWaterBytes;
+    usedBytes += other.usedBytes;
+    allocations += other.allocations;
+    deallocations += other.deallocations;
+    lockWaitNs += other.lockWaitNs;
+    retainedBytes += other.retainedBytes;
+    purgedBytes += other.purgedBytes;
+    return *this;
+  }
+};
+
+/**
+ * Statistics counters of one thread in one pool. Only the owning thread
+ * writes them, with a relaxed load and store instead of a read-modify-write,
+ * so counting costs a couple of plain moves on the hot path.
+ */
+struct ThreadCounters {
+  std::atomic<unsigned long long> allocations{0}, deallocations{0};
+  std::atomic<unsigned long long> allocatedBytes{0}, freedBytes{0};
+  std::atomic<unsigned long long> lockWaitNs{0};
+  ThreadCounters* next = nullptr;
+
+  static void add(std::atomic<unsigned long long>& counter, unsigned long long value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+
+  void onAllocate(size_t bytes) {
+    add(allocations, 1);
+    add(allocatedBytes, bytes);
+  }
+
+  void onDeallocate(size_t bytes) {
+    add(deallocations, 1);
+    add(freedBytes, bytes);
+  }
+
+  void addTo(PoolStats& stats) const {
+    stats.allocations += allocations.load(std::memory_order_relaxed);
+    stats.deallocations += deallocations.load(std::memory_order_relaxed);
+    stats.lockWaitNs += lockWaitNs.load(std::memory_order_relaxed);
+    // blocks freed by another thread make single threads go negative,
+    // the unsigned sum over all threads is still right
+    stats.usedBytes += allocatedBytes.load(std::memory_order_relaxed) - freedBytes.load(std::memory_order_relaxed);
+  }
+};
+
+// entry of the calling thread in a thread_local table indexed by chain id
+template <typename Ref>
+static inline Ref& threadSlot(std::vector<Ref>& table, const ChunkChain& chain) {
+  size_t id = chain.id();
+  if (id >= table.size()) [[unlikely]] {
+    table.resize(id + 1);
+  }
+  return table[id];
+}
+
+struct ThreadCountersRef {
+  unsigned long long serial = 0;
+  ThreadCounters* counters = nullptr;
+};
+
+inline thread_local std::vector<ThreadCountersRef> threadCounters;
+
+/**
+ * ThreadCounters of all threads which used a pool. Threads find their own
+ * through threadCounters by chain id, the chain serial tells apart chains
+ * which reused the same id. Counters stay with the pool after their thread
+ * exits.
+ */
+class CounterRegistry {
+private:
+  std::atomic<ThreadCounters*> head_{nullptr};
+
+public:
+  CounterRegistry() = default;
+  CounterRegistry(const CounterRegistry&) = delete;
+  CounterRegistry& operator=(const CounterRegistry&) = delete;
+
+  ~CounterRegistry() {
+    ThreadCounters* counters = head_.load(std::memory_order_acquire);
+    while (counters) {
+      delete std::exchange(counters, counters->next);
+    }
+  }
+
+  ThreadCounters& local(const ChunkChain& chain) {
+    ThreadCountersRef& ref = threadSlot(threadCounters, chain);
+    if (ref.serial != chain.serial()) [[unlikely]] {
+      ThreadCounters* counters = new ThreadCounters;
+      counters->next = head_.load(std::memory_order_relaxed);
+      while (!head_.compare_exchange_weak(counters->next, counters, std::memory_order_release)) {}
+      ref = ThreadCountersRef{chain.serial(), counters};
+    }
+    return *ref.counters;
+  }
+
+  void addTo(PoolStats& stats) const {
+    for (ThreadCounters* counters = head_.load(std::memory_order_acquire); counters; counters = counters->next) {
+      counters->addTo(stats);
+    }
+  }
+};
+
+/**
+ * Lets the decay thread trim a pool once per idle period: after a whole
+ * tick without allocations and frees, and then not again until there were
+ * some, so neither a busy nor an idle pool is walked over and over.
+ */
+class IdleTrim {
+private:
+  unsigned long long seen_ = 0, trimmed_ = 0;
+
+public:
+  bool due(const CounterRegistry& counters) {
+    PoolStats stats;
+    counters.addTo(stats);
+    unsigned long long traffic = stats.allocations + stats.deallocations;
+    if (std::exchange(seen_, traffic) != traffic || trimmed_ == traffic) {
+      return false;
+    }
+    trimmed_ = traffic;
+    return true;
+  }
+};
+
+static inline PoolStats chainStats(const ChunkChain& chain) {
+  PoolStats stats;
+  stats.reservedBytes = chain.reservedBytes();
+  stats.carvedBytes = chain.carvedBytes();
+  stats.highWaterBytes = chain.highWaterBytes();
+  stats.retainedBytes = chain.retainedBytes();
+  stats.purgedBytes = chain.purgedBytes();
+  return stats;
+}
+
+template <typename T>
+class MemPoolAllocator : public std::allocator<T> {
+private:
+  ChunkChain chain_;
+  Chunk* chunk_;
+  static constexpr int type = 0; 
+  FreeLists free_{};
+  int scopes_ = 0;
+  ThreadCounters counters_;
+
+  // top is atomic only so that stats() may read it from another thread
+  T *bump(size_t bytes) {
+    char *p = chunk_->top.load(std::memory_order_relaxed) - bytes;
+    if (p < chunk_->limit) [[unlikely]] {
+      FreeBlock* last;
+      if (bytes <= MAX_CLASS_SIZE) {
+        if (char* block = takeRecycled(chain_, bytes, free_[sizeClass(bytes)], last)) {
+          return (T*)block;
+        }
+      }
+      chunk_ = chain_.grow(chunk_, bytes);
+      p = chunk_->top.load(std::memory_order_relaxed) - bytes;
+    }
+    chunk_->top.store(p, std::memory_order_relaxed);
+    chain_.bumped(chunk_, p);
+    return (T*)p;
+  }
+
+  void deallocateBlock(void* p, size_t bytes) {
+    counters_.onDeallocate(bytes);
+    if (bytes <= MAX_CLASS_SIZE) {
+      FreeBlock*& head = free_[sizeClass(bytes)];
+      head = new (p) FreeBlock{head};
+    } else {
+      chain_.freeLarge(p, bytes);
+    }
+  }
+
+  static void deallocateRouted(void* pool, void* p, size_t bytes) {
+    static_cast<MemPoolAllocator*>(pool)->deallocateBlock(p, bytes);
+  }
+
+public:
+  explicit MemPoolAllocator(const PoolOptions& options = {}) : chain_(options) {
+    chunk_ = chain_.current();
+    chain_.setDeallocator(this, deallocateRouted);
+  }
+
+  MemPoolAllocator(MemPoolAllocator && a) = delete;
+  MemPoolAllocator(const MemPoolAllocator&) = delete;
+  MemPoolAllocator& operator=(const MemPoolAllocator&) = delete;
+
+  template <class U>
+  explicit MemPoolAllocator(const MemPoolAllocator<U>&) : MemPoolAllocator() {}
+
+  T *allocate(size_t count) {
+    size_t bytes = roundToBlock(sizeof(T) * count);
+    counters_.onAllocate(bytes);
+    if (bytes <= MAX_CLASS_SIZE) {
+      FreeBlock*& head = free_[sizeClass(bytes)];
+      if (FreeBlock* block = head) {
+        head = block->next;
+        return (T*)block;
+      }
+    } else if (char* block = chain_.takeLarge(bytes)) {
+      return (T*)block;
+    }
+    return bump(bytes);
+  }
+
+  void deallocate(T* p, size_t count) {
+    size_t bytes = roundToBlock(sizeof(T) * count);
+    if (!chain_.forward(p, bytes)) [[likely]] {
+      deallocateBlock(p, bytes);
+    }
+  }
+
+  PoolMark mark() {
+    ++scopes_;
+    return PoolMark{chunk_, chunk_->top.load(std::memory_order_relaxed)};
+  }
+
+  void release(const PoolMark& mark) {
+    chain_.release(mark.chunk, mark.top);
+    chunk_ = mark.chunk;
+    free_ = {};
+    --scopes_;
+  }
+
+  bool inScope() const {
+    return scopes_ > 0;
+  }
+
+  // usedBytes keeps counting blocks dropped by release
+  PoolStats stats() const {
+    PoolStats stats = chainStats(chain_);
+    counters_.addTo(stats);
+    return stats;
+  }
+
+  // the free lists are not thread-safe, so only this trims them, not the decay thread
+  void purge() {
+    if (chain_.decays()) {
+      trimFreeLists(free_, chain_);
+    }
+    chain_.purge();
+  }
+
+  template<class U, class... Args>
+  void construct(U* p, Args&&... args) {
+      new (p) U(std::forward<Args>(args)...);
+  }
+
+  template<class U>
+  void destroy(U* p) {
+      (*p).~U();
+  }
+
+  template <class U>
+  struct rebind {
+      using other = MemPoolAllocator<U>;
+  };
+  using value_type = T;
+};
+
+template <typename T>
+class MutexedMemPoolAllocator : public std::allocator<T> {
+private:
+  ChunkChain chain_;
+  Chunk* chunk_;
+  static constexpr int type = 1;
+  std::mutex m_;
+  FreeLists free_{};
+  int scopes_ = 0;
+  CounterRegistry counters_;
+  IdleTrim idleTrim_;
+
+  T *bump(size_t bytes) {
+    char *p = chunk_->top.load(std::memory_order_relaxed) - bytes;
+    if (p < chunk_->limit) [[unlikely]] {
+      FreeBlock* last;
+      if (bytes <= MAX_CLASS_SIZE) {
+        if (char* block = takeRecycled(chain_, bytes, free_[sizeClass(bytes)], last)) {
+          return (T*)block;
+        }
+      }
+      chunk_ = chain_.grow(chunk_, bytes);
+      p = chunk_->top.load(std::memory_order_relaxed) - bytes;
+    }
+    chunk_->top.store(p, std::memory_order_relaxed);
+    chain_.bumped(chunk_, p);
+    return (T*)p;
+  }
+
+  // only a contended lock is timed
+  std::unique_lock<std::mutex> lock(ThreadCounters& counters) {
+    std::unique_lock lock{m_, std::try_to_lock};
+    if (!lock.owns_lock()) [[unlikely]] {
+      auto from = std::chrono::steady_clock::now();
+      lock.lock();
+      auto to = std::chrono::steady_clock::now();
+      ThreadCounters::add(counters.lockWaitNs,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+    }
+    return lock;
+  }
+
+  void deallocateBlock(void* p, size_t bytes) {
+    ThreadCounters& counters = counters_.local(chain_);
+    counters.onDeallocate(bytes);
+    if (bytes <= MAX_CLASS_SIZE) {
+      auto guard = lock(counters);
+      FreeBlock*& head = free_[sizeClass(bytes)];
+      head = new (p) FreeBlock{head};
+    } else {
+      chain_.freeLarge(p, bytes);
+    }
+  }
+
+  static void deallocateRouted(void* pool, void* p, size_t bytes) {
+    static_cast<MutexedMemPoolAllocator*>(pool)->deallocateBlock(p, bytes);
+  }
+
+  // under m_ the bump pointer stays put while the chain purges below it
+  static void trimRouted(void* pool) {
+    auto* self = static_cast<MutexedMemPoolAllocator*>(pool);
+    std::lock_guard lock{self->m_};
+    if (self->idleTrim_.due(self->counters_)) {
+      trimFreeLists(self->free_, self->chain_);
+    }
+    self->chain_.purgeRewound();
+  }
+
+public:
+  explicit MutexedMemPoolAllocator(const PoolOptions& options = {}) : chain_(options) {
+    chunk_ = chain_.current();
+    chain_.setDeallocator(this, deallocateRouted);
+    if (chain_.decays()) {
+      chain_.setTrimmer(this, trimRouted);
+    }
+  }
+
+  ~MutexedMemPoolAllocator() {
+    chain_.setTrimmer(nullptr, nullptr);
+  }
+
+  MutexedMemPoolAllocator(MutexedMemPoolAllocator && a) = delete;
+  MutexedMemPoolAllocator(const MutexedMemPoolAllocator&) = delete;
+  MutexedMemPoolAllocator& operator=(const MutexedMemPoolAllocator&) = delete;
+
+  template <class U>
+  explicit MutexedMemPoolAllocator(const MutexedMemPoolAllocator<U>&) : MutexedMemPoolAllocator() {}
+
+  T *allocate(size_t count) {
+    size_t bytes = roundToBlock(sizeof(T) * count);
+    ThreadCounters& counters = counters_.local(chain_);
+    counters.onAllocate(bytes);
+    if (bytes > MAX_CLASS_SIZE) {
+      if (char* block = chain_.takeLarge(bytes)) {
+        return (T*)block;
+      }
+    }
+    auto guard = lock(counters);
+    if (bytes <= MAX_CLASS_SIZE) {
+      FreeBlock*& head = free_[sizeClass(bytes)];
+      if (FreeBlock* block = head) {
+        head = block->next;
+        return (T*)block;
+      }
+    }
+    return bump(bytes);
+  }
+
+  void deallocate(T* p, size_t count) {
+    size_t bytes = roundToBlock(sizeof(T) * count);
+    if (!chain_.forward(p, bytes)) [[likely]] {
+      deallocateBlock(p, bytes);
+    }
+  }
+
+  PoolMark mark() {
+    std::lock_guard lock{m_};
+    ++scopes_;
+    return PoolMark{chunk_, chunk_->top.load(std::memory_order_relaxed)};
+  }
+
+  // memory allocated since the mark must not be used by other threads anymore
+  void release(const PoolMark& mark) {
+    std::lock_guard lock{m_};
+    chain_.release(mark.chunk, mark.top);
+    chunk_ = mark.chunk;
+    free_ = {};
+    --scopes_;
+  }
+
+  bool inScope() {
+    std::lock_guard lock{m_};
+    return scopes_ > 0;
+  }
+
+  PoolStats stats() const {
+    PoolStats stats = chainStats(chain_);
+    counters_.addTo(stats);
+    return stats;
+  }
+
+  void purge() {
+    std::lock_guard lock{m_};
+    if (chain_.decays()) {
+      trimFreeLists(free_, chain_);
+    }
+    chain_.purge();
+  }
+
+  template<class U, class... Args>
+  void construct(U* p, Args&&... args) {
+      new (p) U(std::forward<Args>(args)...);
+  }
+
+  template<class U>
+  void destroy(U* p) {
+      (*p).~U();
+  }
+
+  template <class U>
+  struct rebind {
+      using other = MutexedMemPoolAllocator<U>;
+  };
+  using value_type = T;
+};
+
+template <typename T>
+class LockFreeMemPoolAllocator : public std::allocator<T> {
+protected:
+  ChunkChain chain_;
+  static constexpr int type = 2;
+  std::array<AtomicFreeList, SIZE_CLASSES> free_;
+  std::atomic<int> scopes_{0};
+  CounterRegistry counters_;
+  IdleTrim idleTrim_;
+  // the decay thread trims concurrently with the owner, release() must not rewind under it
+  std::mutex trimMutex_;
+
+  /**
+   * Takes bytes from the current chunk or, once it is exhausted, from
+   * recycled pages, mapping a new chunk only if there are none. Threads
+   * which overshoot an old chunk just leave its tail unused.
+   */
+  char *bump(size_t bytes) {
+    Chunk* chunk = chain_.current();
+    while (true) {
+      char *p = chunk->top.fetch_sub(bytes, std::memory_order_relaxed) - bytes;
+      if (p >= chunk->limit) [[likely]] {
+        chain_.bumped(chunk, p);
+        return p;
+      }
+      FreeBlock *first, *last;
+      if (bytes <= MAX_CLASS_SIZE) {
+        if (char* block = takeRecycled(chain_, bytes, first, last)) {
+          if (first) {
+            free_[sizeClass(bytes)].push(first, last);
+          }
+          return block;
+        }
+      }
+      chunk = chain_.grow(chunk, bytes);
+    }
+  }
+
+  void deallocateBlock(void* p, size_t bytes) {
+    counters_.local(chain_).onDeallocate(bytes);
+    if (bytes <= MAX_CLASS_SIZE) {
+      free_[sizeClass(bytes)].push(new (p) FreeBlock);
+    } else {
+      chain_.freeLarge(p, bytes);
+    }
+  }
+
+  static void deallocateRouted(void* pool, void* p, size_t bytes) {
+    static_cast<LockFreeMemPoolAllocator*>(pool)->deallocateBlock(p, bytes);
+  }
+
+  /**
+   * Takes the lists away while it sorts them, threads which allocate
+   * meanwhile bump new blocks. Racing pops fail on the changed tags.
+   */
+  void trimFree() {
+    std::lock_guard lock{trimMutex_};
+    ClassedBlocks blocks;
+    for (size_t cls = 0; cls < SIZE_CLASSES; ++cls) {
+      for (FreeBlock* block = free_[cls].popAll(); block; block = block->next) {
+        blocks.emplace_back((char*)block, cls);
+      }
+    }
+    trimBlocks(blocks, chain_);
+    FreeLists firsts{}, lasts{};
+    for (auto block = blocks.rbegin(); block != blocks.rend(); ++block) {
+      FreeBlock*& head = firsts[block->second];
+      auto* linked = (FreeBlock*)block->first;
+      AtomicFreeList::link(linked, head);
+      lasts[block->second] = lasts[block->second] ? lasts[block->second] : linked;
+      head = linked;
+    }
+    for (size_t cls = 0; cls < SIZE_CLASSES; ++cls) {
+      if (firsts[cls]) {
+        free_[cls].push(firsts[cls], lasts[cls]);
+      }
+    }
+  }
+
+  static void trimRouted(void* pool) {
+    auto* self = static_cast<LockFreeMemPoolAllocator*>(pool);
+    if (self->idleTrim_.due(self->counters_)) {
+      self->trimFree();
+    }
+    self->chain_.purgeRewound();
+  }
+
+public:
+  explicit LockFreeMemPoolAllocator(const PoolOptions& options = {}) : chain_(options) {
+    chain_.setDeallocator(this, deallocateRouted);
+    if (chain_.decays()) {
+      chain_.setTrimmer(this, trimRouted);
+    }
+  }
+
+  ~LockFreeMemPoolAllocator() {
+    chain_.setTrimmer(nullptr, nullptr);
+  }
+
+  LockFreeMemPoolAllocator(LockFreeMemPoolAllocator && a) = delete;
+  LockFreeMemPoolAllocator(const LockFreeMemPoolAllocator&) = delete;
+  LockFreeMemPoolAllocator& operator=(const LockFreeMemPoolAllocator&) = delete;
+
+  template <class U>
+  explicit LockFreeMemPoolAllocator(const LockFreeMemPoolAllocator<U>&) : LockFreeMemPoolAllocator() {}
+
+  T *allocate(size_t count) {
+    size_t bytes = roundToBlock(sizeof(T) * count);
+    counters_.local(chain_).onAllocate(bytes);
+    if (bytes <= MAX_CLASS_SIZE) {
+      if (FreeBlock* block = free_[sizeClass(bytes)].pop()) {
+        return (T*)block;
+      }
+    } else if (char* block = chain_.takeLarge(bytes)) {
+      return (T*)block;
+    }
+    return (T*)bump(bytes);
+  }
+
+  void deallocate(T* p, size_t count) {
+    size_t bytes = roundToBlock(sizeof(T) * count);
+    if (!chain_.forward(p, bytes)) [[likely]] {
+      deallocateBlock(p, bytes);
+    }
+  }
+
+  PoolMark mark() {
+    scopes_.fetch_add(1, std::memory_order_relaxed);
+    Chunk* chunk = chain_.current();
+    return PoolMark{chunk, chunk->top.load(std::memory_order_relaxed)};
+  }
+
+  // no other thread may allocate or free concurrently with release
+  void release(const PoolMark& mark) {
+    std::lock_guard lock{trimMutex_};
+    chain_.release(mark.chunk, mark.top);
+    for (auto& list : free_) {
+      list.clear();
+    }
+    scopes_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  bool inScope() const {
+    return scopes_.load(std::memory_order_relaxed) > 0;
+  }
+
+  PoolStats stats() const {
+    PoolStats stats = chainStats(chain_);
+    counters_.addTo(stats);
+    return stats;
+  }
+
+  void purge() {
+    if (chain_.decays()) {
+      trimFree();
+    }
+    chain_.purge();
+  }
+
+  template<class U, class... Args>
+  void construct(U* p, Args&&... args) {
+      new (p) U(std::forward<Args>(args)...);
+  }
+
+  template<class U>
+  void destroy(U* p) {
+      (*p).~U();
+  }
+
+  template <class U>
+  struct rebind {
+      using other = LockFreeMemPoolAllocator<U>;
+  };
+  using value_type = T;
+};
+
+static constexpr size_t SPAN_SIZE = 16 * PAGE_SIZE;
+static_assert(CHUNK_ALIGN % SPAN_SIZE == 0, "chunks must consist of whole spans");
+static_assert(MAX_CLASS_SIZE <= SPAN_SIZE / 4, "a span must hold several blocks of every class");
+
+/**
+ * Per-thread state of ThreadCachedMemPoolAllocator. Only the owning thread
+ * touches ptr, limit and free, other threads push blocks they free to
+ * remote, which the owner drains in a batch before carving a new span.
+ */
+struct ThreadCache {
+  char *ptr = nullptr, *limit = nullptr;
+  FreeLists free{};
+  ThreadCache* next = nullptr;
+  ThreadCounters counters;
+  alignas(64) std::array<std::atomic<FreeBlock*>, SIZE_CLASSES> remote{};
+};
+
+// lies at the lowest address of every SPAN_SIZE-aligned span
+struct SpanHeader {
+  ThreadCache* owner;
+};
+
+static constexpr size_t SPAN_HEADER_SIZE = roundToBlock(sizeof(SpanHeader));
+
+struct ThreadCacheRef {
+  unsigned long long serial = 0;
+  ThreadCache* cache = nullptr;
+};
+
+inline thread_local std::vector<ThreadCacheRef> threadCaches;
+
+/**
+ * LockFreeMemPoolAllocator with a per-thread front-end: every thread grabs
+ * SPAN_SIZE bytes from the shared pool with one fetch_sub and then
+ * bump-allocates inside its span without any atomics.
+ * A freed block returns to the thread which owns its span: directly to the
+ * free lists if it is the calling thread, otherwise through the owner's
+ * lock-free remote queue.
+ * Caches are found through threadCaches by chain id, the chain serial tells
+ * apart allocators which reused the same id. Caches are owned by the pool, so
+ * remote frees to an exited thread stay valid.
+ */
+template <typename T>
+class ThreadCachedMemPoolAllocator : public LockFreeMemPoolAllocator<T> {
+private:
+  using Base = LockFreeMemPoolAllocator<T>;
+  std::atomic<ThreadCache*> caches_{nullptr};
+
+  ThreadCache* localCache() {
+    ThreadCacheRef& ref = threadSlot(threadCaches, this->chain_);
+    if (ref.serial != this->chain_.serial()) {
+      ThreadCache* cache = new ThreadCache;
+      cache->next = caches_.load(std::memory_order_relaxed);
+      while (!caches_.compare_exchange_weak(cache->next, cache, std::memory_order_release)) {}
+      ref = ThreadCacheRef{this->chain_.serial(), cache};
+    }
+    return ref.cache;
+  }
+
+  static void drainRemote(ThreadCache* cache) {
+    for (size_t i = 0; i < SIZE_CLASSES; ++i) {
+      if (!cache->remote[i].load(std::memory_order_relaxed)) {
+        continue;
+      }
+      FreeBlock* block = cache->remote[i].exchange(nullptr, std::memory_order_acquire);
+      while (block) {
+        FreeBlock* next = block->next;
+        block->next = cache->free[i];
+        cache->free[i] = block;
+        block = next;
+      }
+    }
+  }
+
+  // bumps whole spans to keep the shared pointer span-aligned and frees the tail at once
+  T *allocateLarge(size_t bytes) {
+    if (char* block = this->chain_.takeLarge(bytes)) {
+      return (T*)block;
+    }
+    size_t spans = roundUp(bytes, SPAN_SIZE);
+    char* block = this->bump(spans);
+    if (spans > bytes) {
+      this->chain_.freeLarge(block + bytes, spans - bytes);
+    }
+    return (T*)block;
+  }
+
+  T *refill(ThreadCache* cache, size_t bytes) {
+    drainRemote(cache);
+    FreeBlock*& head = cache->free[sizeClass(bytes)];
+    if (FreeBlock* block = head) {
+      head = block->next;
+      return (T*)block;
+    }
+    char* span = this->bump(SPAN_SIZE);
+    cache->ptr = span + SPAN_SIZE;
+    new (span) SpanHeader{cache};
+    cache->limit = span + SPAN_HEADER_SIZE;
+    return (T*)(cache->ptr -= bytes);
+  }
+
+  void deallocateBlock(void* p, size_t bytes) {
+    ThreadCacheRef& ref = threadSlot(threadCaches, this->chain_);
+    ThreadCache* cache = ref.serial == this->chain_.serial() ? ref.cache : localCache();
+    cache->counters.onDeallocate(bytes);
+    if (bytes > MAX_CLASS_SIZE) {
+      this->chain_.freeLarge(p, bytes);
+      return;
+    }
+    ThreadCache* owner = ((SpanHeader*)((uintptr_t)p & ~(SPAN_SIZE - 1)))->owner;
+    FreeBlock* block = new (p) FreeBlock;
+    if (cache == owner) [[likely]] {
+      block->next = owner->free[sizeClass(bytes)];
+      owner->free[sizeClass(bytes)] = block;
+      return;
+    }
+    std::atomic<FreeBlock*>& remote = owner->remote[sizeClass(bytes)];
+    block->next = remote.load(std::memory_order_relaxed);
+    while (!remote.compare_exchange_weak(block->next, block,
+                                         std::memory_order_release, std::memory_order_relaxed)) {}
+  }
+
+  static void deallocateRouted(void* pool, void* p, size_t bytes) {
+    static_cast<ThreadCachedMemPoolAllocator*>(pool)->deallocateBlock(p, bytes);
+  }
+
+public:
+  // chunk tops are CHUNK_ALIGN-aligned and the shared pool is only ever
+  // bumped by whole spans, so every span stays SPAN_SIZE-aligned
+  explicit ThreadCachedMemPoolAllocator(const PoolOptions& options = {}) : Base(options) {
+    this->chain_.setDeallocator(this, deallocateRouted);
+    // only the owning threads may walk their free lists
+    this->chain_.setTrimmer(nullptr, nullptr);
+  }
+
+  ~ThreadCachedMemPoolAllocator() {
+    ThreadCache* cache = caches_.load(std::memory_order_acquire);
+    while (cache) {
+      delete std::exchange(cache, cache->next);
+    }
+  }
+
+  T *allocate(size_t count) {
+    size_t bytes = roundToBlock(sizeof(T) * count);
+    ThreadCacheRef& ref = threadSlot(threadCaches, this->chain_);
+    ThreadCache* cache = ref.serial == this->chain_.serial() ? ref.cache : localCache();
+    cache->counters.onAllocate(bytes);
+    if (bytes > MAX_CLASS_SIZE) [[unlikely]] {
+      return allocateLarge(bytes);
+    }
+    FreeBlock*& head = cache->free[sizeClass(bytes)];
+    if (FreeBlock* block = head) {
+      head = block->next;
+      return (T*)block;
+    }
+    if ((size_t)(cache->ptr - cache->limit) < bytes) [[unlikely]] {
+      return refill(cache, bytes);
+    }
+    return (T*)(cache->ptr -= bytes);
+  }
+
+  void deallocate(T* p, size_t count) {
+    size_t bytes = roundToBlock(sizeof(T) * count);
+    if (!this->chain_.forward(p, bytes)) [[likely]] {
+      deallocateBlock(p, bytes);
+    }
+  }
+
+  PoolStats stats() const {
+    PoolStats stats = chainStats(this->chain_);
+    for (ThreadCache* cache = caches_.load(std::memory_order_acquire); cache; cache = cache->next) {
+      cache->counters.addTo(stats);
+    }
+    return stats;
+  }
+
+  // other threads' caches hold spans and blocks past any mark
+  PoolMark mark() = delete;
+  void release(const PoolMark&) = delete;
+  bool inScope() const = delete;
+
+  template <class U>
+  struct rebind {
+      using other = ThreadCachedMemPoolAllocator<U>;
+  };
+};
@@ -0,0 +1,113 @@
+#pragma once
+#include "mem_pool.h"
+#include <memory>
+#include <sched.h>
+#include <vector>
+
+// allocations between two getcpu calls of a thread
+static constexpr unsigned NUMA_NODE_REFRESH = 256;
+
+struct NumaNodeCache {
+  unsigned node = 0;
+  unsigned countdown = 0;
+};
+
+inline thread_local NumaNodeCache numaNodeCache;
+
+// node of the CPU the calling thread ran on recently
+static inline unsigned currentNumaNode() {
+  NumaNodeCache& cache = numaNodeCache;
+  if (cache.countdown-- == 0) [[unlikely]] {
+    unsigned cpu, node;
+    cache.node = getcpu(&cpu, &node) == 0 ? node : 0;
+    cache.countdown = NUMA_NODE_REFRESH;
+  }
+  return cache.node;
+}
+
+/**
+ * One Pool per NUMA node, with the chunks of each bound to its node.
+ * Threads allocate from the pool of the node they run on, which is looked
+ * up again every NUMA_NODE_REFRESH allocations, so a migrated thread
+ * follows shortly after. Frees go to the pool of the current node as well,
+ * which forwards blocks of other nodes to their owner through the chunk
+ * registry. On a single-node machine this is one plain Pool.
+ */
+template <typename T, template <typename> typename Pool>
+class NumaMemPoolAllocator : public std::allocator<T> {
+private:
+  std::vector<std::unique_ptr<Pool<T>>> nodes_;
+
+  Pool<T>& local() {
+    if (nodes_.size() == 1) {
+      return *nodes_[0];
+    }
+    unsigned node = currentNumaNode();
+    return *nodes_[node < nodes_.size() ? node : 0];
+  }
+
+public:
+  explicit NumaMemPoolAllocator(const PoolOptions& options = {}) {
+    int count = numaNodeCount();
+    for (int node = 0; node < count; ++node) {
+      PoolOptions nodeOptions = options;
+      nodeOptions.numaNode = node;
+      nodes_.push_back(std::make_unique<Pool<T>>(nodeOptions));
+    }
+  }
+
+  NumaMemPoolAllocator(NumaMemPoolAllocator && a) = delete;
+  NumaMemPoolAllocator(const NumaMemPoolAllocator&) = delete;
+  NumaMemPoolAllocator& operator=(const NumaMemPoolAllocator&) = delete;
+
+  template <class U>
+  explicit NumaMemPoolAllocator(const NumaMemPoolAllocator<U, Pool>&) : NumaMemPoolAllocator() {}
+
+  size_t nodes() const {
+    return nodes_.size();
+  }
+
+  T *allocate(size_t count) {
+    return local().allocate(count);
+  }
+
+  void deallocate(T* p, size_t count) {
+    local().deallocate(p, count);
+  }
+
+  PoolStats stats() const {
+    PoolStats stats;
+    for (auto& pool : nodes_) {
+      stats += pool->stats();
+    }
+    return stats;
+  }
+
+  void purge() {
+    for (auto& pool : nodes_) {
+      pool->purge();
+    }
+  }
+
+  template<class U, class... Args>
+  void construct(U* p, Args&&... args) {
+      new (p) U(std::forward<Args>(args)...);
+  }
+
+  template<class U>
+  void destroy(U* p) {
+      (*p).~U();
+  }
+
+  template <class U>
+  struct rebind {
+      using other = NumaMemPoolAllocator<U, Pool>;
+  };
+  using value_type = T;
+};
+
+template <typename T>
+using NumaMutexedMemPoolAllocator = NumaMemPoolAllocator<T, MutexedMemPoolAllocator>;
+
+template <typename T>
+using NumaLockFreeMemPoolAllocator = NumaMemPoolAllocator<T, LockFreeMemPoolAllocator>;
@@ -0,0 +1,191 @@
+#include "persistent_pool.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+static constexpr char PERSISTENT_MAGIC[8] = {'M', 'E', 'M', 'P', 'O', 'O', 'L', '2'};
+static constexpr unsigned long long FILE_GROW_SIZE = 256 * PAGE_SIZE;
+
+// all positions are offsets from the start of the file, 0 is none
+struct PersistentHeader {
+  char magic[8];
+  unsigned long long size;
+  unsigned long long top;
+  unsigned long long root;
+  std::array<unsigned long long, SIZE_CLASSES> free;
+  unsigned long long large;  // free blocks above MAX_CLASS_SIZE by address
+};
+
+// first bytes of a free block above MAX_CLASS_SIZE
+struct LargeFree {
+  unsigned long long next;
+  unsigned long long size;
+};
+
+static_assert(sizeof(PersistentHeader) <= PAGE_SIZE, "the header must fit its page");
+
+static std::system_error systemError(const std::string& what) {
+  return std::system_error(errno, std::generic_category(), what);
+}
+
+PersistentFile::PersistentFile(const std::string& path, const PersistentOptions& options) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd_ == -1) {
+    throw systemError("cannot open " + path);
+  }
+  struct stat st;
+  if (fstat(fd_, &st) == -1) {
+    close(fd_);
+    throw systemError("cannot stat " + path);
+  }
+  created_ = st.st_size == 0;
+  if (created_ && ftruncate(fd_, FILE_GROW_SIZE) == -1) {
+    close(fd_);
+    throw systemError("cannot extend " + path);
+  }
+  capacity_ = roundUp(std::max<unsigned long long>(options.capacity, st.st_size), PAGE_SIZE);
+  // the whole capacity is mapped at once, so blocks never move; pages past
+  // the end of the file are not touched until extend() covers them
+  void* mapped = mmap(NULL, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mapped == MAP_FAILED) {
+    close(fd_);
+    throw systemError("cannot map " + path);
+  }
+  base_ = (char*)mapped;
+  if (created_) {
+    PersistentHeader& h = header();
+    std::memcpy(h.magic, PERSISTENT_MAGIC, sizeof(h.magic));
+    h.size = FILE_GROW_SIZE;
+    h.top = PAGE_SIZE;
+    h.root = 0;
+    h.free = {};
+    h.large = 0;
+  } else if ((unsigned long long)st.st_size < PAGE_SIZE
+             || std::memcmp(header().magic, PERSISTENT_MAGIC, sizeof(PERSISTENT_MAGIC)) != 0
+             || header().size != (unsigned long long)st.st_size) {
+    munmap(base_, capacity_);
+    close(fd_);
+    throw std::runtime_error(path + " is not a pool file");
+  }
+}
+
+PersistentFile::~PersistentFile() {
+  munmap(base_, capacity_);
+  close(fd_);
+}
+
+void PersistentFile::extend(unsigned long long size) {
+  size = std::min(capacity_, std::max(header().size * 2, roundUp(size, FILE_GROW_SIZE)));
+  if (ftruncate(fd_, size) == -1) {
+    throw std::bad_alloc();
+  }
+  header().size = size;
+}
+
+LargeFree& PersistentFile::large(unsigned long long offset) const {
+  return *(LargeFree*)(base_ + offset);
+}
+
+// best fit, the rest of the block stays on the list in its place
+void* PersistentFile::takeLarge(size_t bytes) {
+  unsigned long long* best = nullptr;
+  for (unsigned long long* link = &header().large; *link; link = &large(*link).next) {
+    unsigned long long size = large(*link).size;
+    if (size >= bytes && (!best || size < large(*best).size)) {
+      best = link;
+    }
+  }
+  if (!best) {
+    return nullptr;
+  }
+  unsigned long long block = *best;
+  LargeFree free = large(block);
+  if (free.size == bytes) {
+    *best = free.next;
+  } else {
+    *best = block + bytes;
+    new (base_ + block + bytes) LargeFree{free.next, free.size - bytes};
+  }
+  return base_ + block;
+}
+
+// merges the block with free neighbours so that freed runs can serve larger requests
+void PersistentFile::freeLarge(void* p, size_t bytes) {
+  unsigned long long block = (char*)p - base_;
+  unsigned long long prev = 0;
+  unsigned long long* link = &header().large;
+  while (*link && *link < block) {
+    prev = *link;
+    link = &large(*link).next;
+  }
+  unsigned long long next = *link;
+  if (next && block + bytes == next) {
+    bytes += large(next).size;
+    next = large(next).next;
+  }
+  if (prev && prev + large(prev).size == block) {
+    large(prev) = LargeFree{next, large(prev).size + bytes};
+    return;
+  }
+  new (p) LargeFree{next, bytes};
+  *link = block;
+}
+
+void* PersistentFile::allocate(size_t bytes) {
+  PersistentHeader& h = header();
+  if (bytes <= MAX_CLASS_SIZE) {
+    unsigned long long& head = h.free[sizeClass(bytes)];
+    if (head) {
+      unsigned long long block = head;
+      std::memcpy(&head, base_ + block, sizeof(head));
+      return base_ + block;
+    }
+  } else if (void* block = takeLarge(bytes)) {
+    return block;
+  }
+  if (h.top + bytes > capacity_) {
+    throw std::bad_alloc();
+  }
+  if (h.top + bytes > h.size) {
+    extend(h.top + bytes);
+  }
+  void* p = base_ + h.top;
+  h.top += bytes;
+  return p;
+}
+
+// free blocks keep the offset of the next one in their first bytes
+void PersistentFile::deallocate(void* p, size_t bytes) {
+  if (bytes > MAX_CLASS_SIZE) {
+    freeLarge(p, bytes);
+    return;
+  }
+  unsigned long long& head = header().free[sizeClass(bytes)];
+  std::memcpy(p, &head, sizeof(head));
+  head = (char*)p - base_;
+}
+
+void* PersistentFile::root() const {
+  return header().root ? base_ + header().root : nullptr;
+}
+
+void PersistentFile::setRoot(void* p) {
+  header().root = p ? (char*)p - base_ : 0;
+}
+
+unsigned long long PersistentFile::usedBytes() const {
+  return header().top;
+}
+
+void PersistentFile::sync() {
+  if (msync(base_, header().size, MS_SYNC) == -1) {
+    throw systemError("msync failed");
+  }
+}
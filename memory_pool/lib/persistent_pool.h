@@ -0,0 +1,182 @@
+#pragma once
+#include "mem_pool.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+ * Pointer stored as the distance from its own address, so that it stays
+ * valid wherever the memory holding both it and its target is mapped.
+ * Distance 1 is null: an object cannot start one byte past the pointer.
+ */
+template <typename T>
+class OffsetPtr {
+private:
+  static constexpr ptrdiff_t NULL_OFFSET = 1;
+  ptrdiff_t offset_ = NULL_OFFSET;
+
+  void set(const T* p) {
+    offset_ = p ? (const char*)p - (const char*)this : NULL_OFFSET;
+  }
+
+public:
+  OffsetPtr() = default;
+
+  OffsetPtr(std::nullptr_t) {}
+
+  OffsetPtr(T* p) {
+    set(p);
+  }
+
+  OffsetPtr(const OffsetPtr& other) {
+    set(other.get());
+  }
+
+  OffsetPtr& operator=(const OffsetPtr& other) {
+    set(other.get());
+    return *this;
+  }
+
+  OffsetPtr& operator=(T* p) {
+    set(p);
+    return *this;
+  }
+
+  T* get() const {
+    return offset_ == NULL_OFFSET ? nullptr : (T*)((char*)this + offset_);
+  }
+
+  T* operator->() const {
+    return get();
+  }
+
+  T& operator*() const {
+    return *get();
+  }
+
+  explicit operator bool() const {
+    return offset_ != NULL_OFFSET;
+  }
+};
+
+static constexpr unsigned long long DEFAULT_PERSISTENT_CAPACITY = 1ull << 34;
+
+struct PersistentOptions {
+  // address space reserved for the file, it cannot grow past it
+  unsigned long long capacity = DEFAULT_PERSISTENT_CAPACITY;
+};
+
+struct PersistentHeader;
+struct LargeFree;
+
+/**
+ * A pool in a file mapped with MAP_SHARED. The file starts with a header
+ * page holding the bump offset, the size-class free lists, the list of
+ * free larger blocks and the root object; blocks follow and are
+ * bump-allocated upwards, the file is extended with ftruncate as the pool
+ * grows. Everything in the file refers to other parts of it by offsets, so
+ * reopening the file is a single mmap at any address, with no
+ * deserialization.
+ * Not thread-safe, like MemPoolAllocator.
+ */
+class PersistentFile {
+private:
+  int fd_ = -1;
+  char* base_ = nullptr;
+  unsigned long long capacity_;
+  bool created_ = false;
+
+  PersistentHeader& header() const {
+    return *(PersistentHeader*)base_;
+  }
+
+  void extend(unsigned long long size);
+  LargeFree& large(unsigned long long offset) const;
+  void* takeLarge(size_t bytes);
+  void freeLarge(void* p, size_t bytes);
+
+public:
+  // opens path or creates a new pool file there
+  explicit PersistentFile(const std::string& path, const PersistentOptions& options = {});
+  ~PersistentFile();
+
+  PersistentFile(const PersistentFile&) = delete;
+  PersistentFile& operator=(const PersistentFile&) = delete;
+
+  // true if the constructor made a new, empty pool file
+  bool created() const {
+    return created_;
+  }
+
+  // bytes are rounded by roundToBlock
+  void* allocate(size_t bytes);
+  void deallocate(void* p, size_t bytes);
+
+  void* root() const;
+  void setRoot(void* p);
+
+  // bytes of the file in use, header included
+  unsigned long long usedBytes() const;
+
+  // writes the mapping back to the file
+  void sync();
+};
+
+/**
+ * Allocator over a PersistentFile. Rebound copies share the file, so
+ * containers and nodes of any type end up in the same pool.
+ */
+template <typename T>
+class PersistentMemPoolAllocator : public std::allocator<T> {
+private:
+  std::shared_ptr<PersistentFile> file_;
+
+  template <typename U>
+  friend class PersistentMemPoolAllocator;
+
+public:
+  explicit PersistentMemPoolAllocator(const std::string& path, const PersistentOptions& options = {})
+      : file_(std::make_shared<PersistentFile>(path, options)) {}
+
+  template <class U>
+  explicit PersistentMemPoolAllocator(const PersistentMemPoolAllocator<U>& other) : file_(other.file_) {}
+
+  PersistentFile& file() const {
+    return *file_;
+  }
+
+  T *allocate(size_t count) {
+    return (T*)file_->allocate(roundToBlock(sizeof(T) * count));
+  }
+
+  void deallocate(T* p, size_t count) {
+    file_->deallocate(p, roundToBlock(sizeof(T) * count));
+  }
+
+  template <typename R>
+  R* root() const {
+    return (R*)file_->root();
+  }
+
+  template <typename R>
+  void setRoot(R* p) {
+    file_->setRoot(p);
+  }
+
+  template<class U, class... Args>
+  void construct(U* p, Args&&... args) {
+      new (p) U(std::forward<Args>(args)...);
+  }
+
+  template<class U>
+  void destroy(U* p) {
+      (*p).~U();
+  }
+
+  template <class U>
+  struct rebind {
+      using other = PersistentMemPoolAllocator<U>;
+  };
+  using value_type = T;
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include "mem_pool.h"
+#include <cstddef>
+#include <memory_resource>
+
+/**
+ * A pool allocator behind the std::pmr::memory_resource interface, so that
+ * std::pmr containers can use it without being templated on the pool.
+ * Blocks are BLOCK_ALIGN-aligned; requests for stricter alignment go to
+ * upstream, which also gets them back on deallocation.
+ * Resources compare equal only to themselves.
+ */
+template <template <typename> typename Pool>
+class PoolResource : public std::pmr::memory_resource {
+private:
+  Pool<std::byte> pool_;
+  std::pmr::memory_resource* upstream_;
+
+public:
+  explicit PoolResource(const PoolOptions& options = {},
+                        std::pmr::memory_resource* upstream = std::pmr::new_delete_resource())
+      : pool_(options), upstream_(upstream) {}
+
+  PoolResource(const PoolResource&) = delete;
+  PoolResource& operator=(const PoolResource&) = delete;
+
+  Pool<std::byte>& pool() {
+    return pool_;
+  }
+
+  std::pmr::memory_resource* upstream_resource() const {
+    return upstream_;
+  }
+
+  PoolStats stats() const {
+    return pool_.stats();
+  }
+
+protected:
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    if (alignment > BLOCK_ALIGN) [[unlikely]] {
+      return upstream_->allocate(bytes, alignment);
+    }
+    // every allocation must return a distinct pointer
+    return pool_.allocate(bytes ? bytes : 1);
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+    if (alignment > BLOCK_ALIGN) [[unlikely]] {
+      upstream_->deallocate(p, bytes, alignment);
+      return;
+    }
+    pool_.deallocate((std::byte*)p, bytes ? bytes : 1);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+};
+
+// not thread-safe, one per thread
+using LocalPoolResource = PoolResource<MemPoolAllocator>;
+using MutexedPoolResource = PoolResource<MutexedMemPoolAllocator>;
+using LockFreePoolResource = PoolResource<LockFreeMemPoolAllocator>;
+using CachedPoolResource = PoolResource<ThreadCachedMemPoolAllocator>;
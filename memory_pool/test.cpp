@@ -1,76 +1,42 @@
+#include "mem_pool.h"
+#include "numa_pool.h"
+#include "persistent_pool.h"
+#include "pool_resource.h"
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <cstdlib>
 #include <iostream>
 #include <iomanip>
+#include <linux/perf_event.h>
 #include <memory>
+#include <memory_resource>
+#include <random>
 #include <stdexcept>
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <concepts>
+#include <deque>
 #include <thread>
 #include <unistd.h>
+#include <utility>
 #include <signal.h>
 #include <mutex>
 #include <atomic>
 #include <vector>
+#include <string>
+#include <unordered_map>
 #include <array>
 
 using namespace std;
 
-static constexpr size_t PAGE_SIZE = 1 << 12;
-static constexpr size_t MAX_ALLOCATORS = 20;
-static constexpr unsigned long long PAGE_PTR_MASK = (-1ll) ^ ((1 << 12) - 1);
-
-static const char str[] = "Got SIGSEGV, probably because of bad allocation at Allocator#"; 
-
-static std::array<std::atomic<const void*>, MAX_ALLOCATORS> areas{};
-
-static char * itoa(int val, char *buf)
-{
-  int length = 0;
-  int _val = val;
-  do {
-    ++length;
-    _val /= 10;
-  } while (_val);
-  buf += length;
-  *buf = 0;
-  do {
-    --buf;
-    *buf = '0' + val % 10;
-    val /= 10;
-  } while (val);
-  return buf;
-}
-
-static void (*old_handler)(int, siginfo_t *, void *);
-
-static void handler(int signum, siginfo_t *si, void *p)
-{
-  int id = -1;
-  char * aligned_ptr = (char *)((unsigned long long)si->si_addr & PAGE_PTR_MASK);
-  for (size_t i = 0; i < areas.size(); ++i) {
-    if (areas[i].load(std::memory_order_relaxed) == aligned_ptr) {
-      id = i;
-      break;
-    }
-  }
-  if (id == -1) {
-    old_handler(signum, si, p);
-  } else {
-    char buf[10];
-    const char *id_str = itoa(id, buf);
-    write(STDERR_FILENO, str, sizeof(str) - 1);
-    write(STDERR_FILENO, id_str, std::strlen(id_str));
-    write(STDERR_FILENO, "\n", 1);
-    exit(EXIT_FAILURE);
-  }
-}
-
 /**
  * Returns the current resident set size (physical memory use) measured
  * in bytes, or zero if the value cannot be determined on this OS.
@@ -87,7 +53,7 @@ static size_t getCurrentRSS() {
     return (size_t)0L;
   }
   fclose(fp);
-  return (size_t)rss * 1024;
+  return (size_t)rss * sysconf(_SC_PAGESIZE);
 }
 
 static void get_usage(struct rusage& usage) {
@@ -105,223 +71,20 @@ struct Node {
   unsigned node_id;
 };
 
-static unsigned long long hintElemCount = 0;
-
-static unsigned long long roundToPageSize(unsigned long long size) {
-  return (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
-}
-
-template <typename T>
-class MemPoolAllocator : public std::allocator<T> {
-private:
-  char *mempool_, *ptr;
-  unsigned long long size;
-  int id;
-  static constexpr int type = 0; 
-
-public:
-  static constexpr unsigned long long defaultSize = 128ll * 1024 * PAGE_SIZE; 
-
-  MemPoolAllocator() {
-    size = hintElemCount == 0 ? defaultSize : (roundToPageSize(hintElemCount * sizeof(T) + PAGE_SIZE));
-    mempool_ = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    mprotect(mempool_, PAGE_SIZE, PROT_NONE);
-    ptr = mempool_ + size;
-    id = -1;
-    for (size_t i = 0; i < MAX_ALLOCATORS; ++i) {
-      const void* exp = nullptr;
-      if (areas[i].compare_exchange_weak(exp, mempool_, std::memory_order_relaxed)) {
-        id = i;
-        break;
-      }
-    }
-    if (id == -1) {
-      throw std::invalid_argument("Too many allocators at the same time");
-    }
-  }
-
-  ~MemPoolAllocator() {
-    areas[id].store(nullptr, std::memory_order_relaxed);
-    munmap(mempool_, size);
-  }
-
-  MemPoolAllocator(MemPoolAllocator && a) = delete;
-  MemPoolAllocator(const MemPoolAllocator&) = delete;
-  MemPoolAllocator& operator=(const MemPoolAllocator&) = delete;
-
-  template <class U>
-  explicit MemPoolAllocator(const MemPoolAllocator<U>&) {}
-
-  T *allocate(size_t count) {
-    return (T*)(ptr -= sizeof(T) * count);
-  }
-
-  void deallocate(T*, size_t) {
-    // do nothing
-  }
-
-  template<class U, class... Args>
-  void construct(U* p, Args&&... args) {
-      new (p) U(std::forward<Args>(args)...);
-  }
-
-  template<class U>
-  void destroy(U* p) {
-      (*p).~U();
-  }
-
-  template <class U>
-  struct rebind {
-      using other = MemPoolAllocator<U>;
-  };
-  using value_type = T;
-};
-
-template <typename T>
-class MutexedMemPoolAllocator : public std::allocator<T> {
-private:
-  char *mempool_, *ptr;
-  unsigned long long size;
-  int id;
-  static constexpr int type = 1;
-  std::mutex m_;
-
-public:
-  static constexpr unsigned long long defaultSize = 128ll * 1024 * PAGE_SIZE; 
-
-  MutexedMemPoolAllocator() {
-    size = hintElemCount == 0 ? defaultSize : (roundToPageSize(hintElemCount * sizeof(T) + PAGE_SIZE));
-    mempool_ = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    mprotect(mempool_, PAGE_SIZE, PROT_NONE);
-    ptr = mempool_ + size;
-    id = -1;
-    for (size_t i = 0; i < MAX_ALLOCATORS; ++i) {
-      const void* exp = nullptr;
-      if (areas[i].compare_exchange_weak(exp, mempool_, std::memory_order_relaxed)) {
-        id = i;
-        break;
-      }
-    }
-    if (id == -1) {
-      throw std::invalid_argument("Too many allocators at the same time");
-    }
-  }
-
-  ~MutexedMemPoolAllocator() {
-    areas[id].store(nullptr, std::memory_order_relaxed);
-    munmap(mempool_, size);
-  }
-
-  MutexedMemPoolAllocator(MutexedMemPoolAllocator && a) = delete;
-  MutexedMemPoolAllocator(const MutexedMemPoolAllocator&) = delete;
-  MutexedMemPoolAllocator& operator=(const MutexedMemPoolAllocator&) = delete;
-
-  template <class U>
-  explicit MutexedMemPoolAllocator(const MutexedMemPoolAllocator<U>&) {}
-
-  T *allocate(size_t count) {
-    std::lock_guard lock{m_};
-    return (T*)(ptr -= sizeof(T) * count);
-  }
-
-  void deallocate(T*, size_t) {
-    // do nothing
-  }
-
-  template<class U, class... Args>
-  void construct(U* p, Args&&... args) {
-      new (p) U(std::forward<Args>(args)...);
-  }
-
-  template<class U>
-  void destroy(U* p) {
-      (*p).~U();
-  }
-
-  template <class U>
-  struct rebind {
-      using other = MutexedMemPoolAllocator<U>;
-  };
-  using value_type = T;
-};
-
-template <typename T>
-class LockFreeMemPoolAllocator : public std::allocator<T> {
-private:
-  char *mempool_;
-  std::atomic<char*> ptr;
-  unsigned long long size;
-  int id;
-  static constexpr int type = 2;
-
-public:
-  static constexpr unsigned long long defaultSize = 128ll * 1024 * PAGE_SIZE; 
-
-  LockFreeMemPoolAllocator() {
-    size = hintElemCount == 0 ? defaultSize : (roundToPageSize(hintElemCount * sizeof(T) + PAGE_SIZE));
-    mempool_ = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    mprotect(mempool_, PAGE_SIZE, PROT_NONE);
-    ptr = mempool_ + size;
-    id = -1;
-    for (size_t i = 0; i < MAX_ALLOCATORS; ++i) {
-      const void* exp = nullptr;
-      if (areas[i].compare_exchange_weak(exp, mempool_, std::memory_order_relaxed)) {
-        id = i;
-        break;
-      }
-    }
-    if (id == -1) {
-      throw std::invalid_argument("Too many allocators at the same time");
-    }
-  }
-
-  ~LockFreeMemPoolAllocator() {
-    areas[id].store(nullptr, std::memory_order_relaxed);
-    munmap(mempool_, size);
-  }
-
-  LockFreeMemPoolAllocator(LockFreeMemPoolAllocator && a) = delete;
-  LockFreeMemPoolAllocator(const LockFreeMemPoolAllocator&) = delete;
-  LockFreeMemPoolAllocator& operator=(const LockFreeMemPoolAllocator&) = delete;
-
-  template <class U>
-  explicit LockFreeMemPoolAllocator(const LockFreeMemPoolAllocator<U>&) {}
-
-  T *allocate(size_t count) {
-    return (T*)(ptr.fetch_sub(sizeof(T) * count, std::memory_order_relaxed) - sizeof(T) * count);
-  }
-
-  void deallocate(T*, size_t) {
-    // do nothing
-  }
-
-  template<class U, class... Args>
-  void construct(U* p, Args&&... args) {
-      new (p) U(std::forward<Args>(args)...);
-  }
-
-  template<class U>
-  void destroy(U* p) {
-      (*p).~U();
-  }
-
-  template <class U>
-  struct rebind {
-      using other = LockFreeMemPoolAllocator<U>;
-  };
-  using value_type = T;
-};
-
-
 template <Alloc<Node> Allocator> 
 class List {
   using Traits = std::allocator_traits<Allocator>;
   Node * head;
   Allocator& alloc;
+  // nodes will be released in bulk by an enclosing ArenaScope
+  bool arenaOwned = false;
 
   public:
 
   List(unsigned n, Allocator& alloc) : head(nullptr), alloc(alloc) {
+    if constexpr (ScopedArena<Allocator> && std::is_trivially_destructible_v<Node>) {
+      arenaOwned = alloc.inScope();
+    }
     for (unsigned i = 0; i < n; i++) {
       Node* node = Traits::allocate(alloc, 1);
       Traits::construct(alloc, node, head, i);
@@ -330,47 +93,65 @@ class List {
   }
 
   ~List() {
+    if (arenaOwned) {
+      return;
+    }
     while (head) {
       Node* node = head;
       head = head->next;
       Traits::destroy(alloc, node);
+      Traits::deallocate(alloc, node, 1);
     }
   }
 };
 
+template <typename Allocator>
+static inline void printStats(const Allocator& alloc) {
+  if constexpr (requires { { alloc.stats() } -> std::same_as<PoolStats>; }) {
+    PoolStats stats = alloc.stats();
+    cout << "Pool reserved: " << stats.reservedBytes << " bytes, carved: " << stats.carvedBytes
+        << " bytes, high water: " << stats.highWaterBytes << " bytes, in use: " << stats.usedBytes << " bytes\n";
+    cout << "Pool allocations: " << stats.allocations << ", deallocations: " << stats.deallocations
+        << ", lock wait: " << stats.lockWaitNs / 1000 << " usec\n";
+  }
+}
+
 template <template <typename> typename Allocator>
 requires Alloc<Allocator<Node>, Node>
-static inline void test(unsigned n, bool local = false) {
+static inline void test(unsigned n, bool local = false, unsigned rounds = 1) {
   constexpr int threadsNum = 16;
   struct rusage start, finish;
   get_usage(start);
   auto start_mem = getCurrentRSS();
   if (local) {
-    hintElemCount = n;
     std::vector<std::jthread> threads;
     threads.reserve(threadsNum);
     for (int i = 0; i < threadsNum; ++i) {
-      threads.emplace_back([n](){
+      threads.emplace_back([n, rounds](){
         Allocator<Node> allocator;
-        auto list = List<Allocator<Node>>(n, allocator);
+        for (unsigned r = 0; r < rounds; ++r) {
+          auto list = List<Allocator<Node>>(n, allocator);
+        }
       });
     }
     for (int i = 0; i < threadsNum; ++i) {
       threads[i].join();
     }
   } else {
-    hintElemCount = threadsNum * n;
     Allocator<Node> alloc;
     std::vector<std::jthread> threads;
     threads.reserve(threadsNum);
     for (int i = 0; i < threadsNum; ++i) {
       threads.emplace_back([=, &alloc](){
-        auto list = List<Allocator<Node>>(n, alloc);
+        for (unsigned r = 0; r < rounds; ++r) {
+          auto list = List<Allocator<Node>>(n, alloc);
+        }
       });
     }
     for (int i = 0; i < threadsNum; ++i) {
       threads[i].join();
     }
+    printStats(alloc);
   }
   get_usage(finish);
 
@@ -390,29 +171,401 @@ static inline void test(unsigned n, bool local = false) {
       << overhead << "%\n";
 }
 
+/**
+ * Producers allocate nodes in batches and hand them to consumers on other
+ * threads, which free them. Reuse is only possible if the allocator can
+ * route cross-thread frees back to the allocating side.
+ */
+template <template <typename> typename Allocator>
+requires Alloc<Allocator<Node>, Node>
+static inline void producerConsumerTest(unsigned n) {
+  using Traits = std::allocator_traits<Allocator<Node>>;
+  constexpr int pairsNum = 8;
+  constexpr unsigned batchSize = 1024;
+  constexpr size_t maxBatchesInFlight = 16;
+
+  struct Channel {
+    std::mutex m;
+    std::condition_variable cv;
+    std::deque<Node*> batches;
+  };
 
-int main(const int, const char* argv[]) {
-  struct sigaction sa;
-  sa.sa_flags = SA_SIGINFO;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_sigaction = handler;
+  auto start_mem = getCurrentRSS();
+  auto from = std::chrono::steady_clock::now();
+  {
+    Allocator<Node> alloc;
+    std::vector<Channel> channels(pairsNum);
+    std::vector<std::jthread> threads;
+    threads.reserve(2 * pairsNum);
+    for (int i = 0; i < pairsNum; ++i) {
+      Channel& ch = channels[i];
+      threads.emplace_back([n, &ch, &alloc](){
+        for (unsigned i = 0; i < n; i += batchSize) {
+          Node* head = nullptr;
+          for (unsigned j = 0; j < batchSize; ++j) {
+            Node* node = Traits::allocate(alloc, 1);
+            Traits::construct(alloc, node, head, i + j);
+            head = node;
+          }
+          std::unique_lock lock{ch.m};
+          ch.cv.wait(lock, [&ch](){ return ch.batches.size() < maxBatchesInFlight; });
+          ch.batches.push_back(head);
+          ch.cv.notify_all();
+        }
+        std::lock_guard lock{ch.m};
+        ch.batches.push_back(nullptr);
+        ch.cv.notify_all();
+      });
+      threads.emplace_back([&ch, &alloc](){
+        while (true) {
+          Node* head;
+          {
+            std::unique_lock lock{ch.m};
+            ch.cv.wait(lock, [&ch](){ return !ch.batches.empty(); });
+            head = ch.batches.front();
+            ch.batches.pop_front();
+            ch.cv.notify_all();
+          }
+          if (!head) {
+            break;
+          }
+          while (head) {
+            Node* node = head;
+            head = head->next;
+            Traits::destroy(alloc, node);
+            Traits::deallocate(alloc, node, 1);
+          }
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    printStats(alloc);
+  }
+  auto to = std::chrono::steady_clock::now();
+  auto time_used = std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+  cout << "Time used: " << time_used << " usec\n";
+  uint64_t ops = 2ull * pairsNum * (n + batchSize - 1) / batchSize * batchSize;
+  cout << "Throughput: " << std::fixed << std::setprecision(1)
+      << ops / double(time_used) << " Mops/s\n";
+  struct rusage usage;
+  get_usage(usage);
+  cout << "Memory used: " << usage.ru_maxrss * 1024 - start_mem << " bytes\n";
+}
+
+/**
+ * Request-scoped workload: every request builds an n-node List and drops
+ * it. With scoped set the list lives in an ArenaScope and is released in
+ * O(1) instead of walking and freeing every node.
+ */
+template <template <typename> typename Allocator>
+requires ScopedArena<Allocator<Node>>
+static inline void arenaTest(unsigned n, unsigned requests, bool scoped) {
+  Allocator<Node> alloc;
+  auto from = std::chrono::steady_clock::now();
+  for (unsigned r = 0; r < requests; ++r) {
+    if (scoped) {
+      ArenaScope scope{alloc};
+      auto list = List<Allocator<Node>>(n, alloc);
+    } else {
+      auto list = List<Allocator<Node>>(n, alloc);
+    }
+  }
+  auto to = std::chrono::steady_clock::now();
+  cout << "Time used: "
+      << std::chrono::duration_cast<std::chrono::microseconds>(to - from).count() << " usec\n";
+}
+
+/**
+ * A long-lived arena pool serves one peak request of peak nodes, is left
+ * alone for twice the decay time and then serves small requests for idle
+ * milliseconds. With decay the chunks only the peak needed are unmapped
+ * and the pages it used in the first chunk are purged without any further
+ * calls, the small requests do not bring them back; without it RSS stays
+ * at the peak.
+ */
+static inline void decayTest(long long decayMs, unsigned peak, unsigned idleMs) {
+  MutexedMemPoolAllocator<Node> alloc{PoolOptions{.decayMs = decayMs, .purge = Purge::DontNeed}};
+  auto start_mem = getCurrentRSS();
+  auto request = [&alloc](unsigned n) {
+    ArenaScope scope{alloc};
+    auto list = List<MutexedMemPoolAllocator<Node>>(n, alloc);
+  };
+  request(peak);
+  cout << "RSS after peak: " << getCurrentRSS() - start_mem << " bytes\n";
+  std::this_thread::sleep_for(std::chrono::milliseconds{2 * std::max(decayMs, 0ll)});
+  cout << "RSS after no calls: " << getCurrentRSS() - start_mem << " bytes\n";
+  auto from = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - from < std::chrono::milliseconds{idleMs}) {
+    request(1000);
+    std::this_thread::sleep_for(std::chrono::milliseconds{1});
+  }
+  cout << "RSS after idle: " << getCurrentRSS() - start_mem << " bytes\n";
+  PoolStats stats = alloc.stats();
+  cout << "Reserved: " << stats.reservedBytes << " bytes, retained: " << stats.retainedBytes
+      << " bytes, purged: " << stats.purgedBytes << " bytes\n";
+}
 
-  struct sigaction oa;
-  sigaction(SIGSEGV, &sa, &oa);
-  old_handler = oa.sa_sigaction;
+struct PersistentNode {
+  OffsetPtr<PersistentNode> next;
+  unsigned node_id;
+};
+
+/**
+ * Builds an n-node list in a pool file on the first run and persists it.
+ * Later runs map the file and walk the list right away, with no rebuild.
+ */
+static inline void persistTest(const std::string& path, unsigned n) {
+  using Traits = std::allocator_traits<PersistentMemPoolAllocator<PersistentNode>>;
+  auto from = std::chrono::steady_clock::now();
+  PersistentMemPoolAllocator<PersistentNode> alloc{path};
+  bool created = alloc.file().created();
+  if (created) {
+    PersistentNode* head = nullptr;
+    for (unsigned i = 0; i < n; ++i) {
+      PersistentNode* node = Traits::allocate(alloc, 1);
+      Traits::construct(alloc, node, head, i);
+      head = node;
+    }
+    alloc.setRoot(head);
+    alloc.file().sync();
+  }
+  unsigned long long sum = 0, count = 0;
+  for (PersistentNode* node = alloc.root<PersistentNode>(); node; node = node->next.get()) {
+    sum += node->node_id;
+    ++count;
+  }
+  auto to = std::chrono::steady_clock::now();
+  cout << (created ? "Built and persisted " : "Reopened ") << count << " nodes, checksum " << sum << "\n";
+  cout << "Time used: "
+      << std::chrono::duration_cast<std::chrono::microseconds>(to - from).count() << " usec\n";
+  cout << "File used: " << alloc.file().usedBytes() << " bytes\n";
+}
+
+/**
+ * Fills std::pmr containers from resource: a map of n strings too long for
+ * the small string buffer, then a vector of n ints grown one by one.
+ */
+template <typename Resource>
+static inline void pmrTest(const char* name, unsigned n) {
+  Resource resource;
+  auto from = std::chrono::steady_clock::now();
+  {
+    std::pmr::unordered_map<unsigned, std::pmr::string> map{&resource};
+    std::pmr::vector<unsigned> vector{&resource};
+    for (unsigned i = 0; i < n; ++i) {
+      map.emplace(i, std::pmr::string(32, 'a' + i % 26));
+      vector.push_back(i);
+    }
+    for (unsigned i = 0; i < n; i += 2) {
+      map.erase(i);
+    }
+  }
+  auto to = std::chrono::steady_clock::now();
+  cout << name << ": "
+      << std::chrono::duration_cast<std::chrono::microseconds>(to - from).count() << " usec\n";
+}
+
+/**
+ * Creates more pools than there used to be allocator slots and frees every
+ * node through the neighbouring pool, which forwards it to its owner.
+ */
+static inline void manyPoolsTest(unsigned pools, unsigned n) {
+  using Traits = std::allocator_traits<LockFreeMemPoolAllocator<Node>>;
+  std::vector<std::unique_ptr<LockFreeMemPoolAllocator<Node>>> allocs;
+  for (unsigned i = 0; i < pools; ++i) {
+    allocs.push_back(std::make_unique<LockFreeMemPoolAllocator<Node>>(PoolOptions{.chunkSize = CHUNK_ALIGN}));
+  }
+  std::vector<Node*> nodes(n);
+  auto from = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < pools; ++i) {
+    for (auto& node : nodes) {
+      node = Traits::allocate(*allocs[i], 1);
+    }
+    for (auto node : nodes) {
+      Traits::deallocate(*allocs[(i + 1) % pools], node, 1);
+    }
+  }
+  auto to = std::chrono::steady_clock::now();
+  unsigned long long misrouted = 0;
+  for (auto& alloc : allocs) {
+    PoolStats stats = alloc->stats();
+    misrouted += stats.allocations != stats.deallocations;
+  }
+  cout << "Pools: " << pools << ", misrouted: " << misrouted << "\n";
+  cout << "Time used: "
+      << std::chrono::duration_cast<std::chrono::microseconds>(to - from).count() << " usec\n";
+}
+
+/**
+ * Opens a counter of data TLB load misses of the calling thread,
+ * returns -1 if perf events are not permitted.
+ */
+static int openDtlbMissCounter() {
+  struct perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+      | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static size_t getAnonHugePages() {
+  FILE* fp = fopen("/proc/self/smaps_rollup", "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  char line[256];
+  size_t kb = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(fp);
+  return kb * 1024;
+}
+
+/**
+ * Links n pool nodes in random order and measures one pointer-chasing walk
+ * over them, the access pattern of List::~List on a pool shared by
+ * several threads.
+ */
+static inline void tlbTest(unsigned n, PageSize pageSize) {
+  MemPoolAllocator<Node> alloc{PoolOptions{.pageSize = pageSize}};
+  std::vector<Node*> nodes(n);
+  for (auto& node : nodes) {
+    node = alloc.allocate(1);
+  }
+  std::shuffle(nodes.begin(), nodes.end(), std::mt19937{42});
+  Node* head = nullptr;
+  for (unsigned i = 0; i < n; ++i) {
+    head = new (nodes[i]) Node{head, i};
+  }
+  std::vector<Node*>().swap(nodes);
+
+  int fd = openDtlbMissCounter();
+  if (fd != -1) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  auto from = std::chrono::steady_clock::now();
+  unsigned long long sum = 0;
+  for (Node* node = head; node; node = node->next) {
+    sum += node->node_id;
+  }
+  auto to = std::chrono::steady_clock::now();
+  long long misses = -1;
+  if (fd != -1) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = -1;
+    }
+    close(fd);
+  }
+
+  cout << "Checksum: " << sum << "\n";
+  cout << "Traversal time: "
+      << std::chrono::duration_cast<std::chrono::microseconds>(to - from).count() << " usec\n";
+  if (misses == -1) {
+    cout << "dTLB misses: n/a (perf events not permitted)\n";
+  } else {
+    cout << "dTLB misses: " << misses << "\n";
+  }
+  cout << "AnonHugePages: " << getAnonHugePages() << " bytes\n";
+}
+
+
+int main(const int argc, const char* argv[]) {
+  installGuardPageHandler();
 
   constexpr int n = 1'000'000;
 
   std::string allocator_name = argv[1];
+  if (allocator_name == "Arena") {
+    constexpr unsigned m = 1'000'000;
+    constexpr unsigned requests = 16;
+    cout << "Arena walk:\n";
+    arenaTest<MemPoolAllocator>(m, requests, false);
+    cout << "Arena scope:\n";
+    arenaTest<MemPoolAllocator>(m, requests, true);
+    return EXIT_SUCCESS;
+  }
+  if (allocator_name == "Decay") {
+    constexpr unsigned m = 4'000'000;
+    cout << "Decay off:\n";
+    decayTest(-1, m, 500);
+    cout << "Decay 100 ms:\n";
+    decayTest(100, m, 500);
+    return EXIT_SUCCESS;
+  }
+  if (allocator_name == "Persist") {
+    persistTest(argc > 2 ? argv[2] : "mempool.pool", 1'000'000);
+    return EXIT_SUCCESS;
+  }
+  if (allocator_name == "Pmr") {
+    constexpr unsigned m = 1'000'000;
+    pmrTest<std::pmr::monotonic_buffer_resource>("monotonic_buffer_resource", m);
+    pmrTest<std::pmr::unsynchronized_pool_resource>("unsynchronized_pool_resource", m);
+    pmrTest<LocalPoolResource>("LocalPoolResource", m);
+    pmrTest<MutexedPoolResource>("MutexedPoolResource", m);
+    pmrTest<LockFreePoolResource>("LockFreePoolResource", m);
+    pmrTest<CachedPoolResource>("CachedPoolResource", m);
+    return EXIT_SUCCESS;
+  }
+  if (allocator_name == "ManyPools") {
+    manyPoolsTest(1000, 10'000);
+    return EXIT_SUCCESS;
+  }
+  if (allocator_name == "TLB") {
+    // 16M nodes, the footprint of the 16-thread List benchmark
+    constexpr unsigned m = 16'000'000;
+    cout << "TLB 4 KiB pages:\n";
+    tlbTest(m, PageSize::Small);
+    cout << "TLB huge pages" << (hugePagesAvailable() ? "" : " (THP unavailable, 4 KiB fallback)") << ":\n";
+    tlbTest(m, PageSize::Huge);
+    return EXIT_SUCCESS;
+  }
+  if (allocator_name == "ProducerConsumer") {
+    // every producer allocates 4M nodes, the pool only grows past
+    // the nodes in flight if frees cannot be reused
+    constexpr unsigned m = 4'000'000;
+    allocator_name = argv[2];
+    cout << "ProducerConsumer " << allocator_name << ":\n";
+    if (allocator_name == "Default") {
+      producerConsumerTest<std::allocator>(m);
+    } else if (allocator_name == "MutexedMemPool") {
+      producerConsumerTest<MutexedMemPoolAllocator>(m);
+    } else if (allocator_name == "LockFreeMemPool") {
+      producerConsumerTest<LockFreeMemPoolAllocator>(m);
+    } else if (allocator_name == "CachedMemPool") {
+      producerConsumerTest<ThreadCachedMemPoolAllocator>(m);
+    } else if (allocator_name == "NumaLockFreeMemPool") {
+      producerConsumerTest<NumaLockFreeMemPoolAllocator>(m);
+    }
+    return EXIT_SUCCESS;
+  }
+  unsigned rounds = argc > 2 ? std::stoul(argv[2]) : 1;
   cout << allocator_name << ":\n";
   if (allocator_name == "Default") {
-    test<std::allocator>(n);
+    test<std::allocator>(n, false, rounds);
   } else if (allocator_name == "MutexedMemPool") {
-    test<MutexedMemPoolAllocator>(n);
+    test<MutexedMemPoolAllocator>(n, false, rounds);
   } else if (allocator_name == "LockFreeMemPool") {
-    test<LockFreeMemPoolAllocator>(n);
+    test<LockFreeMemPoolAllocator>(n, false, rounds);
+  } else if (allocator_name == "CachedMemPool") {
+    test<ThreadCachedMemPoolAllocator>(n, false, rounds);
+  } else if (allocator_name == "NumaMutexedMemPool") {
+    test<NumaMutexedMemPoolAllocator>(n, false, rounds);
+  } else if (allocator_name == "NumaLockFreeMemPool") {
+    test<NumaLockFreeMemPoolAllocator>(n, false, rounds);
   } else if (allocator_name == "LocalMemPool") {
-    test<MemPoolAllocator>(n, true);
+    test<MemPoolAllocator>(n, true, rounds);
   }
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,463 @@
+#include <gtest/gtest.h>
+#include "mem_pool.h"
+#include "persistent_pool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+TEST(SizeClassTest, ClassesAreContiguous) {
+  size_t last = 0;
+  for (size_t size = 1; size <= MAX_CLASS_SIZE; ++size) {
+    size_t block = roundToBlock(size);
+    ASSERT_GE(block, size);
+    ASSERT_LE(block - size, std::max<size_t>(BLOCK_ALIGN - 1, size / 4));
+    ASSERT_EQ(roundToBlock(block), block);
+    size_t cls = sizeClass(block);
+    ASSERT_LT(cls, SIZE_CLASSES);
+    ASSERT_EQ(classSize(cls), block);
+    ASSERT_LE(cls - last, 1u);
+    last = cls;
+  }
+  EXPECT_EQ(last, SIZE_CLASSES - 1);
+  EXPECT_EQ(roundToBlock(MAX_CLASS_SIZE + 1) % PAGE_SIZE, 0u);
+}
+
+template <typename Pool>
+class PoolTest : public ::testing::Test {};
+
+using Pools = ::testing::Types<MemPoolAllocator<char>, MutexedMemPoolAllocator<char>,
+                               LockFreeMemPoolAllocator<char>, ThreadCachedMemPoolAllocator<char>>;
+TYPED_TEST_SUITE(PoolTest, Pools);
+
+TYPED_TEST(PoolTest, ReusesFreedBlocks) {
+  TypeParam pool;
+  char* a = pool.allocate(24);
+  char* b = pool.allocate(24);
+  EXPECT_NE(a, b);
+  pool.deallocate(a, 24);
+  // 24 and 32 bytes share a size class
+  EXPECT_EQ(pool.allocate(32), a);
+  pool.deallocate(b, 24);
+  EXPECT_NE(pool.allocate(64), b);
+}
+
+TYPED_TEST(PoolTest, GrowsPastFirstChunk) {
+  TypeParam pool{PoolOptions{.chunkSize = CHUNK_ALIGN}};
+  std::set<char*> blocks;
+  for (unsigned i = 0; i < 4 * CHUNK_ALIGN / 256; ++i) {
+    char* p = pool.allocate(256);
+    std::fill(p, p + 256, (char)i);
+    blocks.insert(p);
+  }
+  EXPECT_EQ(blocks.size(), 4 * CHUNK_ALIGN / 256);
+  EXPECT_GT(pool.stats().reservedBytes, CHUNK_ALIGN);
+  // a block larger than the next chunk size gets a chunk of its own
+  char* large = pool.allocate(64 * CHUNK_ALIGN);
+  large[0] = large[64 * CHUNK_ALIGN - 1] = 1;
+  EXPECT_GE(pool.stats().reservedBytes, 64 * CHUNK_ALIGN);
+}
+
+TYPED_TEST(PoolTest, CountsAllocations) {
+  TypeParam pool;
+  std::vector<char*> blocks;
+  for (int i = 0; i < 10; ++i) {
+    blocks.push_back(pool.allocate(20));
+  }
+  for (int i = 0; i < 4; ++i) {
+    pool.deallocate(blocks[i], 20);
+  }
+  PoolStats stats = pool.stats();
+  EXPECT_EQ(stats.allocations, 10u);
+  EXPECT_EQ(stats.deallocations, 4u);
+  EXPECT_EQ(stats.usedBytes, 6 * roundToBlock(20));
+  EXPECT_GE(stats.carvedBytes, 10 * roundToBlock(20));
+  EXPECT_GE(stats.highWaterBytes, stats.carvedBytes);
+  EXPECT_GE(stats.reservedBytes, stats.carvedBytes);
+}
+
+TYPED_TEST(PoolTest, FindsOwnerOfForeignBlocks) {
+  TypeParam owner, other;
+  char* p = owner.allocate(48);
+  Chunk* chunk = ChunkRegistry::find(p);
+  ASSERT_NE(chunk, nullptr);
+  EXPECT_GE(p, chunk->limit);
+  EXPECT_LT(p, chunk->base + chunk->size);
+  std::unique_ptr<char[]> heap{new char[48]};
+  EXPECT_EQ(ChunkRegistry::find(heap.get()), nullptr);
+  // freed through the wrong pool, the block goes back to its owner
+  other.deallocate(p, 48);
+  EXPECT_EQ(owner.allocate(48), p);
+  EXPECT_EQ(owner.stats().deallocations, 1u);
+  EXPECT_EQ(other.stats().deallocations, 0u);
+}
+
+// blocks of 257 B to 64 KiB freed in random order, round after round
+template <typename Pool>
+static unsigned long long churn(Pool& pool, int rounds) {
+  std::mt19937 random{42};
+  std::uniform_int_distribution<size_t> sizes{MAX_SMALL_SIZE + 1, 16 * PAGE_SIZE};
+  for (int round = 0; round < rounds; ++round) {
+    std::vector<std::pair<char*, size_t>> blocks;
+    for (int i = 0; i < 256; ++i) {
+      size_t size = sizes(random);
+      char* p = (char*)pool.allocate(size);
+      p[0] = p[size - 1] = 1;
+      blocks.emplace_back(p, size);
+    }
+    std::shuffle(blocks.begin(), blocks.end(), random);
+    for (auto [p, size] : blocks) {
+      pool.deallocate(p, size);
+    }
+  }
+  return pool.stats().carvedBytes;
+}
+
+TYPED_TEST(PoolTest, RecyclesBlocksAboveSmallClasses) {
+  TypeParam pool;
+  unsigned long long warm = churn(pool, 5);
+  unsigned long long later = churn(pool, 45);
+  EXPECT_LE(later, warm + warm / 4);
+}
+
+// polls for up to two seconds, decay runs on its own thread
+template <typename Predicate>
+static bool eventually(Predicate predicate) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::seconds{2};
+  while (!predicate() && std::chrono::steady_clock::now() < until) {
+    std::this_thread::sleep_for(std::chrono::milliseconds{5});
+  }
+  return predicate();
+}
+
+static constexpr PoolOptions DECAY_OPTIONS{.decayMs = 10, .purge = Purge::DontNeed};
+
+TYPED_TEST(PoolTest, PurgesFreeLargeBlocksWhenIdle) {
+  TypeParam pool{DECAY_OPTIONS};
+  std::vector<char*> blocks;
+  for (int i = 0; i < 8; ++i) {
+    blocks.push_back(pool.allocate(16 * PAGE_SIZE));
+    blocks.back()[0] = 1;
+  }
+  for (char* p : blocks) {
+    pool.deallocate(p, 16 * PAGE_SIZE);
+  }
+  // no further calls into the pool
+  EXPECT_TRUE(eventually([&pool] { return pool.stats().purgedBytes >= 8 * 16 * PAGE_SIZE; }));
+}
+
+template <typename Pool>
+class TrimTest : public ::testing::Test {};
+
+// the pools whose free lists the decay thread may walk
+using TrimmedPools = ::testing::Types<MutexedMemPoolAllocator<char>, LockFreeMemPoolAllocator<char>>;
+TYPED_TEST_SUITE(TrimTest, TrimmedPools);
+
+TYPED_TEST(TrimTest, PurgesFreeSmallBlocksWhenIdle) {
+  TypeParam pool{DECAY_OPTIONS};
+  std::vector<char*> blocks;
+  for (int i = 0; i < 4096; ++i) {
+    blocks.push_back(pool.allocate(48));
+    blocks.back()[0] = 1;
+  }
+  // every other block stays, the pages between them cannot go
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    if (i < blocks.size() / 2 || i % 2) {
+      pool.deallocate(blocks[i], 48);
+    }
+  }
+  // a trim in the middle of the loop may leave a page or two at its cut
+  EXPECT_TRUE(eventually([&pool] { return pool.stats().purgedBytes >= 2048 * 48 - 4 * PAGE_SIZE; }));
+  EXPECT_LT(pool.stats().purgedBytes, 3072 * 48);
+}
+
+// allocates count blocks of size, frees them all and returns the reserved bytes
+template <typename Pool>
+static unsigned long long fillAndFree(Pool& pool, size_t size, int count) {
+  std::vector<char*> blocks;
+  for (int i = 0; i < count; ++i) {
+    blocks.push_back(pool.allocate(size));
+    blocks.back()[0] = 1;
+  }
+  for (char* p : blocks) {
+    pool.deallocate(p, size);
+  }
+  return pool.stats().reservedBytes;
+}
+
+TYPED_TEST(TrimTest, ReusesTrimmedPagesForOtherClasses) {
+  TypeParam pool{PoolOptions{.chunkSize = CHUNK_ALIGN, .decayMs = 10}};
+  unsigned long long reserved = fillAndFree(pool, 48, 3 * CHUNK_ALIGN / 2 / 48);
+  for (size_t size : {96, 32, 160}) {
+    unsigned long long purged = pool.stats().purgedBytes;
+    EXPECT_TRUE(eventually([&pool, purged] { return pool.stats().purgedBytes > purged; }));
+    EXPECT_EQ(fillAndFree(pool, size, 3 * CHUNK_ALIGN / 2 / size), reserved);
+  }
+}
+
+TYPED_TEST(TrimTest, PurgesRewoundPagesWhenIdle) {
+  TypeParam pool{DECAY_OPTIONS};
+  char* low = nullptr;
+  auto resident = [&low] {
+    std::vector<unsigned char> pages(1024);
+    mincore(low, 1024 * PAGE_SIZE, pages.data());
+    return std::count_if(pages.begin(), pages.end(), [](unsigned char page) { return page & 1; });
+  };
+  {
+    ArenaScope scope{pool};
+    for (int i = 0; i < 1024; ++i) {
+      low = pool.allocate(PAGE_SIZE);
+      low[0] = 1;
+    }
+    EXPECT_EQ(resident(), 1024);
+  }
+  // one peak and no further calls, the pages below the mark must still go
+  EXPECT_TRUE(eventually([&resident] { return resident() == 0; }));
+  EXPECT_GE(pool.stats().purgedBytes, 1024 * PAGE_SIZE);
+}
+
+TYPED_TEST(TrimTest, ReleaseWhileTrimming) {
+  // the decay thread trims every millisecond, a release may land in the middle
+  TypeParam pool{PoolOptions{.decayMs = 0}};
+  for (int round = 0; round < 20; ++round) {
+    {
+      ArenaScope scope{pool};
+      fillAndFree(pool, 64, 1 << 16);
+      std::this_thread::sleep_for(std::chrono::microseconds{round * 151 % 3000});
+    }
+    // a trim which outlived the release would hand rewound blocks out twice
+    std::this_thread::sleep_for(std::chrono::milliseconds{5});
+    ArenaScope scope{pool};
+    char* large = pool.allocate(16 * PAGE_SIZE);
+    std::vector<char*> blocks;
+    for (int i = 0; i < 1 << 16; ++i) {
+      char* p = pool.allocate(64);
+      ASSERT_TRUE(p + 64 <= large || p >= large + 16 * PAGE_SIZE);
+      blocks.push_back(p);
+    }
+    std::sort(blocks.data(), blocks.data() + blocks.size());
+    ASSERT_EQ(std::adjacent_find(blocks.data(), blocks.data() + blocks.size()), blocks.data() + blocks.size());
+  }
+}
+
+TYPED_TEST(TrimTest, BumpsWhilePurgingRewoundPages) {
+  // with decayMs 0 the decay thread purges below the bump pointer on every tick
+  TypeParam pool{PoolOptions{.decayMs = 0, .purge = Purge::DontNeed}};
+  for (int round = 0; round < 20; ++round) {
+    {
+      ArenaScope scope{pool};
+      fillAndFree(pool, 256, 1 << 12);
+    }
+    ArenaScope scope{pool};
+    std::vector<std::thread> threads;
+    for (char tag = 1; tag <= 4; ++tag) {
+      threads.emplace_back([&pool, tag] {
+        std::vector<char*> blocks;
+        for (int i = 0; i < 1 << 10; ++i) {
+          blocks.push_back(pool.allocate(256));
+          std::fill(blocks.back(), blocks.back() + 256, tag);
+          if (i % 64 == 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds{200});
+          }
+        }
+        // a block purged or handed out twice lost its tag
+        for (char* p : blocks) {
+          EXPECT_EQ(std::count(p, p + 256, tag), 256);
+        }
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+}
+
+TEST(TrimTest, PurgeTrimsLocalPool) {
+  MemPoolAllocator<char> pool{PoolOptions{.chunkSize = CHUNK_ALIGN, .decayMs = 10}};
+  unsigned long long reserved = fillAndFree(pool, 48, 3 * CHUNK_ALIGN / 2 / 48);
+  pool.purge();
+  EXPECT_GE(pool.stats().purgedBytes, 3 * CHUNK_ALIGN / 2 - 8 * PAGE_SIZE);
+  for (size_t size : {96, 32, 160}) {
+    EXPECT_EQ(fillAndFree(pool, size, 3 * CHUNK_ALIGN / 2 / size), reserved);
+    pool.purge();
+  }
+}
+
+TEST(ThreadCacheTest, RemoteFreesReturnToOwner) {
+  ThreadCachedMemPoolAllocator<char> pool;
+  char* p = pool.allocate(16);
+  std::thread{[&pool, p]() {
+    pool.deallocate(p, 16);
+  }}.join();
+  // the owner drains its remote queue once its span is used up
+  bool reused = false;
+  for (size_t i = 0; i < 2 * SPAN_SIZE / 16 && !reused; ++i) {
+    reused = pool.allocate(16) == p;
+  }
+  EXPECT_TRUE(reused);
+}
+
+TEST(ThreadCacheTest, ThreadsGetOwnSpans) {
+  ThreadCachedMemPoolAllocator<char> pool;
+  char* mine = pool.allocate(16);
+  char* theirs = nullptr;
+  std::thread{[&pool, &theirs]() {
+    theirs = pool.allocate(16);
+  }}.join();
+  auto span = [](char* p) {
+    return (uintptr_t)p & ~(SPAN_SIZE - 1);
+  };
+  EXPECT_NE(span(mine), span(theirs));
+}
+
+template <typename Pool>
+class ArenaTest : public ::testing::Test {};
+
+using Arenas = ::testing::Types<MemPoolAllocator<char>, MutexedMemPoolAllocator<char>, LockFreeMemPoolAllocator<char>>;
+TYPED_TEST_SUITE(ArenaTest, Arenas);
+
+TYPED_TEST(ArenaTest, ReleaseRewinds) {
+  TypeParam pool{PoolOptions{.chunkSize = CHUNK_ALIGN}};
+  char* before = pool.allocate(64);
+  unsigned long long carved = pool.stats().carvedBytes;
+  unsigned long long reserved = pool.stats().reservedBytes;
+  char* first = nullptr;
+  {
+    ArenaScope scope{pool};
+    EXPECT_TRUE(pool.inScope());
+    first = pool.allocate(64);
+    // past the first chunk
+    for (int i = 0; i < 1000; ++i) {
+      pool.allocate(4096);
+    }
+    EXPECT_GT(pool.stats().reservedBytes, reserved);
+  }
+  EXPECT_FALSE(pool.inScope());
+  EXPECT_EQ(pool.stats().carvedBytes, carved);
+  EXPECT_EQ(pool.stats().reservedBytes, reserved);
+  EXPECT_EQ(pool.allocate(64), first);
+  EXPECT_NE(first, before);
+}
+
+TYPED_TEST(ArenaTest, ReleaseWhilePrefaulting) {
+  // every release unmaps the chunks the helper may be populating
+  TypeParam pool{PoolOptions{.chunkSize = CHUNK_ALIGN, .prefault = Prefault::Background,
+                             .prefaultWindow = CHUNK_ALIGN}};
+  for (int round = 0; round < 20; ++round) {
+    ArenaScope scope{pool};
+    for (int i = 0; i < 1000; ++i) {
+      pool.allocate(4096)[0] = 1;
+    }
+  }
+  EXPECT_EQ(pool.stats().reservedBytes, CHUNK_ALIGN);
+}
+
+TYPED_TEST(ArenaTest, UnmapsRetainedChunksWhenIdle) {
+  TypeParam pool{PoolOptions{.chunkSize = CHUNK_ALIGN, .decayMs = 10}};
+  {
+    ArenaScope scope{pool};
+    for (int i = 0; i < 2000; ++i) {
+      pool.allocate(4096)[0] = 1;
+    }
+    EXPECT_GT(pool.stats().reservedBytes, CHUNK_ALIGN);
+  }
+  EXPECT_TRUE(eventually([&pool] { return pool.stats().retainedBytes == 0; }));
+  EXPECT_EQ(pool.stats().reservedBytes, CHUNK_ALIGN);
+}
+
+class PersistentTest : public ::testing::Test {
+protected:
+  std::string path_;
+
+  void SetUp() override {
+    char name[] = "/tmp/mempool_test_XXXXXX";
+    int fd = mkstemp(name);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    unlink(name);
+    path_ = name;
+  }
+
+  void TearDown() override {
+    unlink(path_.c_str());
+  }
+};
+
+struct PersistentNode {
+  OffsetPtr<PersistentNode> next;
+  unsigned value;
+};
+
+TEST_F(PersistentTest, ReloadsRoot) {
+  unsigned long long used;
+  {
+    PersistentFile file{path_};
+    EXPECT_TRUE(file.created());
+    PersistentNode* head = nullptr;
+    for (unsigned i = 0; i < 1000; ++i) {
+      head = new (file.allocate(sizeof(PersistentNode))) PersistentNode{head, i};
+    }
+    file.setRoot(head);
+    file.sync();
+    used = file.usedBytes();
+  }
+  PersistentFile file{path_};
+  EXPECT_FALSE(file.created());
+  EXPECT_EQ(file.usedBytes(), used);
+  unsigned expected = 1000;
+  for (auto* node = (PersistentNode*)file.root(); node; node = node->next.get()) {
+    EXPECT_EQ(node->value, --expected);
+  }
+  EXPECT_EQ(expected, 0u);
+}
+
+// PersistentFile has no stats(), churn only needs carvedBytes
+class PersistentChurn {
+private:
+  PersistentFile& file_;
+
+public:
+  explicit PersistentChurn(PersistentFile& file) : file_(file) {}
+
+  void* allocate(size_t size) {
+    return file_.allocate(roundToBlock(size));
+  }
+
+  void deallocate(void* p, size_t size) {
+    file_.deallocate(p, roundToBlock(size));
+  }
+
+  PoolStats stats() const {
+    return PoolStats{.carvedBytes = file_.usedBytes()};
+  }
+};
+
+TEST_F(PersistentTest, RecyclesBlocksAboveSmallClasses) {
+  PersistentFile file{path_};
+  PersistentChurn pool{file};
+  unsigned long long warm = churn(pool, 5);
+  unsigned long long later = churn(pool, 45);
+  EXPECT_LE(later, warm + warm / 4);
+}
+
+TEST_F(PersistentTest, ReusesFreedBlocksAfterReload) {
+  void* freed;
+  {
+    PersistentFile file{path_};
+    file.allocate(32);
+    freed = file.allocate(32);
+    file.setRoot(file.allocate(32));
+    // offsets survive the reload, addresses need not
+    freed = (void*)((char*)freed - (char*)file.root());
+    file.deallocate((char*)file.root() + (ptrdiff_t)freed, 32);
+  }
+  PersistentFile file{path_};
+  EXPECT_EQ(file.allocate(32), (char*)file.root() + (ptrdiff_t)freed);
+}
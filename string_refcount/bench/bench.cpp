@@ -0,0 +1,508 @@
+#include "atomic_string_handle.h"
+#include "string_handle.h"
+#include "string_interner.h"
+#include "string_sort.h"
+#include "pool_resource.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <malloc.h>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * StringHandle benchmarks, one scenario per run:
+ *
+ *   string_bench sso [COUNT]
+ *   string_bench lookup [COUNT]
+ *   string_bench intern [COUNT]
+ *   string_bench alloc [COUNT]
+ *   string_bench concat [COUNT]
+ *   string_bench ingest [COUNT]
+ *   string_bench sort [COUNT]
+ *   string_bench atomic [COUNT]
+ *
+ * Every scenario prints one line per variant with the time of each phase.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+static double millisSince(Clock::time_point from) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - from).count();
+}
+
+// resident bytes of the process, in total and outside file-backed mappings
+struct Resident {
+    size_t total = 0, anonymous = 0;
+};
+
+static Resident resident() {
+    Resident bytes;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return bytes;
+    }
+    size_t size = 0, total = 0, shared = 0;
+    if (fscanf(statm, "%zu %zu %zu", &size, &total, &shared) == 3) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        bytes.total = total * page;
+        bytes.anonymous = (total - shared) * page;
+    }
+    fclose(statm);
+    return bytes;
+}
+
+static long minorFaults() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+// count NUL-terminated strings of minLength..maxLength lowercase letters
+static std::vector<std::string> randomStrings(size_t count, size_t minLength, size_t maxLength) {
+    std::mt19937_64 random(42);
+    std::uniform_int_distribution<size_t> length(minLength, maxLength);
+    std::uniform_int_distribution<int> letter('a', 'z');
+    std::vector<std::string> strings(count);
+    for (auto& str : strings) {
+        str.resize(length(random));
+        for (auto& c : str) {
+            c = (char)letter(random);
+        }
+    }
+    return strings;
+}
+
+/**
+ * Short strings, inline in the handle versus forced to the heap: build,
+ * copy, read and destroy count handles.
+ */
+static void benchSso(size_t count) {
+    auto strings = randomStrings(count, 1, StringHandle::MAX_INLINE);
+    for (bool inlined : {true, false}) {
+        auto start = Clock::now();
+        std::vector<StringHandle> handles;
+        handles.reserve(count);
+        for (const auto& str : strings) {
+            handles.push_back(inlined ? StringHandle{str.c_str()} : StringHandle::OnHeap(str.c_str()));
+        }
+        double build = millisSince(start);
+
+        start = Clock::now();
+        std::vector<StringHandle> copies{handles};
+        double copy = millisSince(start);
+
+        start = Clock::now();
+        size_t length = 0;
+        for (const auto& handle : copies) {
+            length += std::strlen(handle.get());
+        }
+        double read = millisSince(start);
+
+        start = Clock::now();
+        copies.clear();
+        handles.clear();
+        double destroy = millisSince(start);
+
+        printf("%-6s build %8.1f ms  copy %8.1f ms  read %8.1f ms  destroy %8.1f ms  (%zu chars)\n",
+               inlined ? "inline" : "heap", build, copy, read, destroy, length);
+    }
+}
+
+// what hash maps keyed by StringHandle did before the length and hash were cached
+struct RescanHash {
+    size_t operator()(const StringHandle& handle) const {
+        return std::hash<std::string_view>{}(handle.get());
+    }
+};
+
+struct RescanEqual {
+    bool operator()(const StringHandle& a, const StringHandle& b) const {
+        return std::strcmp(a.get(), b.get()) == 0;
+    }
+};
+
+/**
+ * Hash map keyed by COUNT / 10 heap strings, looked up COUNT times through
+ * copies of the keys, half of them present: cached hash and length versus
+ * rescanning the characters on every hash and compare.
+ */
+template <typename Hash, typename Equal>
+static void benchLookup(const char* name, const std::vector<StringHandle>& keys,
+                        const std::vector<StringHandle>& probes) {
+    auto start = Clock::now();
+    std::unordered_map<StringHandle, size_t, Hash, Equal> map;
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        map.emplace(keys[i], i);
+    }
+    double build = millisSince(start);
+
+    start = Clock::now();
+    size_t found = 0;
+    for (const auto& probe : probes) {
+        found += map.count(probe);
+    }
+    double lookup = millisSince(start);
+    printf("%-6s build %8.1f ms  lookup %8.1f ms  (%zu found)\n", name, build, lookup, found);
+}
+
+static void benchLookup(size_t count) {
+    std::vector<StringHandle> keys;
+    for (const auto& str : randomStrings(count / 10, 16, 64)) {
+        keys.emplace_back(str.c_str());
+    }
+    std::mt19937_64 random(7);
+    std::vector<StringHandle> probes;
+    probes.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        probes.push_back(keys[random() % keys.size()]);
+    }
+    benchLookup<std::hash<StringHandle>, std::equal_to<StringHandle>>("cached", keys, probes);
+    benchLookup<RescanHash, RescanEqual>("rescan", keys, probes);
+}
+
+/**
+ * COUNT strings with 1% distinct contents, interned and copied one by one,
+ * then COUNT lookups of present strings split between 1 to 8 threads.
+ */
+static void benchIntern(size_t count) {
+    auto distinct = randomStrings(std::max<size_t>(count / 100, 1), 16, 64);
+    std::mt19937_64 random(11);
+    std::vector<const char *> strings(count);
+    for (auto& str : strings) {
+        str = distinct[random() % distinct.size()].c_str();
+    }
+
+    StringInterner interner;
+    for (bool interned : {true, false}) {
+        auto start = Clock::now();
+        std::vector<StringHandle> handles;
+        handles.reserve(count);
+        size_t bytes = 0;
+        for (const char *str : strings) {
+            handles.push_back(interned ? interner.Intern(str) : StringHandle{str});
+            bytes += sizeof(StringHeader) + handles.back().size() + 1;
+        }
+        double build = millisSince(start);
+        if (interned) {
+            InternStats stats = interner.Stats();
+            bytes = stats.bytes;
+            printf("intern build %8.1f ms  %zu strings  %.1f MiB  saved %.1f MiB  (%zu hits of %zu)\n",
+                   build, stats.strings, bytes / 1048576.0, stats.savedBytes / 1048576.0,
+                   stats.hits, stats.requests);
+        } else {
+            printf("copy   build %8.1f ms  %zu strings  %.1f MiB\n", build, handles.size(), bytes / 1048576.0);
+        }
+    }
+
+    // keeps every distinct string alive, so lookups always hit
+    std::vector<StringHandle> pinned;
+    for (const auto& str : distinct) {
+        pinned.push_back(interner.Intern(str.c_str()));
+    }
+    for (unsigned threads = 1; threads <= 8; threads *= 2) {
+        auto start = Clock::now();
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                for (size_t i = t; i < count; i += threads) {
+                    StringHandle handle = interner.Intern(strings[i]);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        double millis = millisSince(start);
+        printf("lookup %u threads %8.1f ms  %6.2f Mops/s\n", threads, millis, count / millis / 1000);
+    }
+}
+
+/**
+ * COUNT heap strings of 8 to 23 characters, the shortest which are not
+ * inline, built and destroyed with every string allocator; then the
+ * resource itself is dropped.
+ */
+static void benchAlloc(size_t count) {
+    auto strings = randomStrings(count, StringHandle::MAX_INLINE + 1, 23);
+    using Factory = std::function<std::unique_ptr<std::pmr::memory_resource>()>;
+    std::vector<std::pair<const char *, Factory>> resources = {
+        {"new", nullptr},
+        {"MemPool", [] { return std::make_unique<LocalPoolResource>(); }},
+        {"LockFreeMemPool", [] { return std::make_unique<LockFreePoolResource>(); }},
+        {"monotonic", [] { return std::make_unique<std::pmr::monotonic_buffer_resource>(); }},
+    };
+    for (const auto& [name, factory] : resources) {
+        auto start = Clock::now();
+        std::unique_ptr<std::pmr::memory_resource> resource = factory ? factory() : nullptr;
+        std::vector<StringHandle> handles;
+        handles.reserve(count);
+        for (const auto& str : strings) {
+            handles.emplace_back(str.c_str(), str.size(), resource.get());
+        }
+        double build = millisSince(start);
+
+        start = Clock::now();
+        handles.clear();
+        double destroy = millisSince(start);
+
+        start = Clock::now();
+        resource.reset();
+        double drop = millisSince(start);
+        printf("%-15s build %8.1f ms  destroy %8.1f ms  drop %8.1f ms\n", name, build, destroy, drop);
+    }
+}
+
+/**
+ * A log of COUNT / 1000 shared fragments of 16 to 64 characters assembled
+ * one fragment at a time and read once: by copying the log into a new
+ * handle on every append, with a rope, and with std::string as reference.
+ */
+static void benchConcat(size_t count) {
+    std::vector<StringHandle> fragments;
+    for (const auto& str : randomStrings(64, 16, 64)) {
+        fragments.emplace_back(str.c_str());
+    }
+    size_t appends = std::max<size_t>(count / 1000, 1);
+
+    auto start = Clock::now();
+    StringHandle copied{""};
+    std::string buffer;
+    for (size_t i = 0; i < appends; ++i) {
+        buffer.assign(copied.get(), copied.size());
+        buffer += fragments[i % fragments.size()].view();
+        copied = buffer.c_str();
+    }
+    size_t length = std::strlen(copied.get());
+    printf("copy   %8.1f ms  (%zu chars)\n", millisSince(start), length);
+
+    start = Clock::now();
+    StringHandle rope;
+    for (size_t i = 0; i < appends; ++i) {
+        rope += fragments[i % fragments.size()];
+    }
+    double build = millisSince(start);
+    start = Clock::now();
+    length = std::strlen(rope.get());
+    double flatten = millisSince(start);
+    start = Clock::now();
+    rope = nullptr;
+    double free = millisSince(start);
+    printf("rope   %8.1f ms  (append %.1f ms, flatten %.1f ms, free %.1f ms, %zu chars)\n",
+           build + flatten + free, build, flatten, free, length);
+
+    start = Clock::now();
+    std::string reference;
+    for (size_t i = 0; i < appends; ++i) {
+        reference += fragments[i % fragments.size()].view();
+    }
+    length = std::strlen(reference.c_str());
+    printf("string %8.1f ms  (%zu chars)\n", millisSince(start), length);
+}
+
+/**
+ * A temporary file of COUNT / 10 lines of 8 to 120 characters, mapped
+ * read-only; every line is loaded as a copied or as a borrowed handle, then
+ * all handles are read once. Growth of the resident set, of its anonymous
+ * part and minor faults are taken while the handles are alive.
+ */
+static void benchIngest(size_t count) {
+    FILE *file = std::tmpfile();
+    if (!file) {
+        perror("tmpfile");
+        return;
+    }
+    size_t fileSize = 0;
+    for (const auto& line : randomStrings(std::max<size_t>(count / 10, 1), 8, 120)) {
+        fprintf(file, "%s\n", line.c_str());
+        fileSize += line.size() + 1;
+    }
+    fflush(file);
+
+    for (bool borrowed : {false, true}) {
+        // freed heap pages would otherwise be reused without showing up
+        malloc_trim(0);
+        Resident before = resident();
+        long faults = minorFaults();
+        auto start = Clock::now();
+        void *mapped = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (mapped == MAP_FAILED) {
+            perror("mmap");
+            return;
+        }
+        const char *data = static_cast<const char *>(mapped);
+        std::vector<StringHandle> lines;
+        for (const char *line = data, *end = data + fileSize; line < end;) {
+            auto newline = static_cast<const char *>(std::memchr(line, '\n', end - line));
+            size_t length = newline - line;
+            lines.push_back(borrowed ? StringHandle::Borrow(line, length) : StringHandle{line, length});
+            line = newline + 1;
+        }
+        double load = millisSince(start);
+
+        start = Clock::now();
+        size_t hash = 0;
+        for (const auto& line : lines) {
+            hash ^= line.Hash();
+        }
+        double read = millisSince(start);
+        Resident after = resident();
+        faults = minorFaults() - faults;
+
+        start = Clock::now();
+        lines.clear();
+        munmap(mapped, fileSize);
+        double release = millisSince(start);
+        printf("%-8s load %8.1f ms  read %8.1f ms  release %8.1f ms  rss +%.1f MiB (anonymous +%.1f MiB)  "
+               "minor faults %ld  (%zu)\n",
+               borrowed ? "borrowed" : "copied", load, read, release,
+               (static_cast<double>(after.total) - before.total) / 1048576.0,
+               (static_cast<double>(after.anonymous) - before.anonymous) / 1048576.0, faults, hash % 1000);
+    }
+    fclose(file);
+}
+
+/**
+ * COUNT heap strings of 8 to 32 characters, half of them behind a shared
+ * 12-character prefix, sorted with std::sort and strcmp on get(), with
+ * std::sort and operator<, and with SortStrings on 1 and on all threads.
+ */
+static void benchSort(size_t count) {
+    std::vector<StringHandle> strings;
+    strings.reserve(count);
+    size_t i = 0;
+    for (const auto& str : randomStrings(count, 8, 32)) {
+        strings.emplace_back((i++ % 2 ? "/var/log/app" + str : str).c_str());
+    }
+    auto run = [&strings](const char *name, const std::function<void(std::vector<StringHandle>&)>& sort) {
+        std::vector<StringHandle> copy{strings};
+        auto start = Clock::now();
+        sort(copy);
+        double millis = millisSince(start);
+        bool sorted = std::is_sorted(copy.begin(), copy.end());
+        printf("%-14s %9.1f ms%s\n", name, millis, sorted ? "" : "  NOT SORTED");
+    };
+    run("strcmp", [](auto& copy) {
+        std::sort(copy.begin(), copy.end(), [](const StringHandle& a, const StringHandle& b) {
+            return std::strcmp(a.get(), b.get()) < 0;
+        });
+    });
+    run("operator<", [](auto& copy) {
+        std::sort(copy.begin(), copy.end());
+    });
+    run("radix 1", [](auto& copy) {
+        SortStrings(copy, 1);
+    });
+    char name[32];
+    snprintf(name, sizeof(name), "radix %u", std::max(1u, std::thread::hardware_concurrency()));
+    run(name, [](auto& copy) {
+        SortStrings(copy);
+    });
+}
+
+/**
+ * 1 to 8 threads read a shared 40-character string COUNT times in total
+ * while a writer replaces it every 100 microseconds: from an
+ * AtomicStringHandle snapshot, from an owning Load(), and under a mutex
+ * guarding a std::string.
+ */
+static void benchAtomic(size_t count) {
+    auto values = randomStrings(16, 40, 40);
+    struct MutexString {
+        std::mutex mutex;
+        std::string value;
+    };
+    AtomicStringHandle slot{StringHandle{values[0].c_str()}};
+    MutexString guarded{{}, values[0]};
+
+    using Read = std::function<size_t()>;
+    std::vector<std::pair<const char *, Read>> readers = {
+        {"snapshot", [&slot] {
+            auto snapshot = slot.Read();
+            return snapshot.view().size() + snapshot.view()[0];
+        }},
+        {"load", [&slot] {
+            StringHandle value = slot.Load();
+            return value.size() + value.get()[0];
+        }},
+        {"mutex", [&guarded] {
+            std::lock_guard lock{guarded.mutex};
+            return guarded.value.size() + guarded.value[0];
+        }},
+    };
+    for (const auto& [name, read] : readers) {
+        for (unsigned threads = 1; threads <= 8; threads *= 2) {
+            std::atomic<bool> done{false};
+            std::thread writer([&] {
+                for (size_t i = 1; !done.load(std::memory_order_relaxed); ++i) {
+                    const std::string& value = values[i % values.size()];
+                    slot.Store(StringHandle{value.c_str()});
+                    {
+                        std::lock_guard lock{guarded.mutex};
+                        guarded.value = value;
+                    }
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            });
+            auto start = Clock::now();
+            std::vector<std::thread> workers;
+            std::atomic<size_t> total{0};
+            for (unsigned t = 0; t < threads; ++t) {
+                workers.emplace_back([&, t] {
+                    size_t sum = 0;
+                    for (size_t i = t; i < count; i += threads) {
+                        sum += read();
+                    }
+                    total += sum;
+                });
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
+            double millis = millisSince(start);
+            done = true;
+            writer.join();
+            printf("%-8s %u threads %8.1f ms  %7.2f Mreads/s  (%zu)\n",
+                   name, threads, millis, count / millis / 1000, total.load() % 1000);
+        }
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    std::map<std::string, std::function<void(size_t)>> scenarios = {
+        {"sso", benchSso},
+        {"lookup", static_cast<void (*)(size_t)>(benchLookup)},
+        {"intern", benchIntern},
+        {"alloc", benchAlloc},
+        {"concat", benchConcat},
+        {"ingest", benchIngest},
+        {"sort", benchSort},
+        {"atomic", benchAtomic},
+    };
+    auto scenario = argc > 1 ? scenarios.find(argv[1]) : scenarios.end();
+    if (scenario == scenarios.end()) {
+        fprintf(stderr, "Usage: %s SCENARIO [COUNT]\nScenarios:", argv[0]);
+        for (const auto& [name, run] : scenarios) {
+            fprintf(stderr, " %s", name.c_str());
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+    size_t count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 10'000'000;
+    scenario->second(count);
+    return 0;
+}
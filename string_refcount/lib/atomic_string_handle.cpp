@@ -0,0 +1,201 @@
+#include "atomic_string_handle.h"
+#include <array>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+constexpr uint64_t ACTIVE = 1;
+
+/**
+ * Epoch based reclamation shared by all slots. A reader announces the
+ * global epoch in its own record before loading a slot and clears the
+ * record when done. The epoch only advances once every active record
+ * announces the current one, so a value retired in epoch e is unreachable
+ * for all readers by epoch e + 2.
+ */
+struct alignas(64) ReaderRecord {
+    // epoch << 1 | ACTIVE while pinned, 0 otherwise
+    std::atomic<uint64_t> announced{0};
+    std::atomic<bool> used{false};
+};
+
+struct Retired {
+    std::uintptr_t word;
+    uint64_t epoch;
+};
+
+std::atomic<uint64_t> globalEpoch{0};
+std::array<ReaderRecord, AtomicStringHandle::MAX_READERS> records;
+// also taken by readers without a record while they copy a value
+std::mutex retiredMutex;
+std::vector<Retired> retired;
+// size of retired, read by Unpin without the lock
+std::atomic<size_t> retiredCount{0};
+
+// the record of the calling thread, claimed on first use and given back on thread exit
+struct ThreadRecord {
+    ReaderRecord *record = nullptr;
+    unsigned pins = 0;
+
+    // nullptr if all records are taken
+    ReaderRecord *Get() {
+        if (record == nullptr) {
+            for (auto& candidate : records) {
+                bool expected = false;
+                if (candidate.used.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                    record = &candidate;
+                    break;
+                }
+            }
+        }
+        return record;
+    }
+
+    ~ThreadRecord() {
+        if (record) {
+            record->used.store(false, std::memory_order_release);
+        }
+    }
+};
+
+thread_local ThreadRecord threadRecord;
+
+// false if the thread has no record and must not borrow
+bool Pin() {
+    if (threadRecord.pins > 0) {
+        ++threadRecord.pins;
+        return true;
+    }
+    ReaderRecord *record = threadRecord.Get();
+    if (record == nullptr) [[unlikely]] {
+        return false;
+    }
+    threadRecord.pins = 1;
+    // seq_cst with the slot loads and the scan in Reclaim: the announcement
+    // is visible to writers before the slot is read
+    record->announced.store(globalEpoch.load(std::memory_order_relaxed) << 1 | ACTIVE, std::memory_order_seq_cst);
+    return true;
+}
+
+/**
+ * Advances the epoch as far as no reader is behind, at most twice, and
+ * returns the retired words which are two epochs old for the caller to
+ * release. Without pinned readers everything retired so far expires.
+ * Under retiredMutex.
+ */
+std::vector<std::uintptr_t> Reclaim() {
+    uint64_t epoch = globalEpoch.load(std::memory_order_relaxed);
+    for (int step = 0; step < 2; ++step) {
+        bool behind = false;
+        for (const auto& record : records) {
+            uint64_t announced = record.announced.load(std::memory_order_seq_cst);
+            if ((announced & ACTIVE) && announced >> 1 != epoch) {
+                behind = true;
+                break;
+            }
+        }
+        if (behind) {
+            break;
+        }
+        globalEpoch.store(++epoch, std::memory_order_release);
+    }
+    std::vector<std::uintptr_t> expired;
+    std::erase_if(retired, [&expired, epoch](const Retired& entry) {
+        if (entry.epoch + 2 > epoch) {
+            return false;
+        }
+        expired.push_back(entry.word);
+        return true;
+    });
+    retiredCount.store(retired.size(), std::memory_order_relaxed);
+    return expired;
+}
+
+/**
+ * Returns the retired words the caller must release. A thread whose pin
+ * saw the epoch advance may have kept a writer from reclaiming, so its last
+ * snapshot reclaims in its place, as no Store() may follow. The check is
+ * not ordered against the writer's scan, in a close race the values wait
+ * for the next Store() or Unpin() after an advance.
+ */
+std::vector<std::uintptr_t> Unpin() {
+    if (--threadRecord.pins > 0) {
+        return {};
+    }
+    ReaderRecord *record = threadRecord.record;
+    uint64_t announced = record->announced.load(std::memory_order_relaxed);
+    record->announced.store(0, std::memory_order_release);
+    if (announced >> 1 == globalEpoch.load(std::memory_order_relaxed)
+        || retiredCount.load(std::memory_order_relaxed) == 0) [[likely]] {
+        return {};
+    }
+    std::lock_guard lock{retiredMutex};
+    return Reclaim();
+}
+
+}  // namespace
+
+AtomicStringHandle::Snapshot::Snapshot(const AtomicStringHandle& slot) : pinned_(Pin()) {
+    handle_ = pinned_ ? Borrowed(slot.word_.load(std::memory_order_seq_cst)) : slot.Load();
+}
+
+AtomicStringHandle::Snapshot::~Snapshot() {
+    if (pinned_) {
+        for (std::uintptr_t word : Unpin()) {
+            Adopt(word);
+        }
+    }
+}
+
+// the slot keeps its reference, the handle shares it without a count of its own
+StringHandle AtomicStringHandle::Borrowed(std::uintptr_t word) {
+    return Adopt((word & StringHandle::HEAP_TAG) ? word | StringHandle::BORROWED_TAG : word);
+}
+
+StringHandle AtomicStringHandle::Copied(std::uintptr_t word) {
+    StringHandle value = Adopt(word);
+    StringHandle copy{value};
+    Release(value);
+    return copy;
+}
+
+AtomicStringHandle::~AtomicStringHandle() {
+    Exchange(StringHandle{});
+}
+
+/**
+ * Without an epoch record the copy is taken under retiredMutex: a value
+ * the slot still holds is only released after Exchange() retires it under
+ * that lock.
+ */
+StringHandle AtomicStringHandle::Load() const {
+    if (!Pin()) [[unlikely]] {
+        std::lock_guard lock{retiredMutex};
+        return Copied(word_.load(std::memory_order_seq_cst));
+    }
+    StringHandle copy = Copied(word_.load(std::memory_order_seq_cst));
+    for (std::uintptr_t word : Unpin()) {
+        Adopt(word);
+    }
+    return copy;
+}
+
+StringHandle AtomicStringHandle::Exchange(StringHandle value) {
+    std::uintptr_t old = word_.exchange(Release(value), std::memory_order_seq_cst);
+    if (!(old & StringHandle::HEAP_TAG)) {
+        return Adopt(old);
+    }
+    // readers may still borrow the slot's reference, the caller gets its own
+    StringHandle copy = Copied(old);
+    std::vector<std::uintptr_t> expired;
+    {
+        std::lock_guard lock{retiredMutex};
+        retired.push_back(Retired{old, globalEpoch.load(std::memory_order_relaxed)});
+        expired = Reclaim();
+    }
+    for (std::uintptr_t word : expired) {
+        Adopt(word);
+    }
+    return copy;
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include "string_handle.h"
+#include <atomic>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * A StringHandle which threads may read and replace concurrently, like
+ * std::atomic<std::shared_ptr>. The slot owns one reference to its value.
+ * Read() gives a Snapshot which borrows the value without touching its
+ * refcount: readers only write to a per-thread epoch record, so they never
+ * share a cache line with each other or with writers. A replaced value is
+ * released once every snapshot which could still see it is gone (epoch
+ * based reclamation): by Store() if no snapshot is alive, otherwise
+ * normally when the last such snapshot ends. If that end races with the
+ * store, the value waits for the next store or snapshot end which reclaims.
+ * Destroying the slot releases its value the same way.
+ */
+class AtomicStringHandle {
+public:
+    // threads with an epoch record, further readers fall back to a lock
+    static constexpr size_t MAX_READERS = 256;
+
+    /**
+     * Pins the current epoch for the calling thread while alive, so the
+     * value it borrows stays valid even if the slot is stored to. Should be
+     * short-lived: it holds back reclamation of every replaced value.
+     */
+    class Snapshot {
+    public:
+        ~Snapshot();
+
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+
+        const StringHandle& handle() const {
+            return handle_;
+        }
+
+        const char *get() const {
+            return handle_.get();
+        }
+
+        std::string_view view() const {
+            return handle_.view();
+        }
+
+    private:
+        StringHandle handle_;
+        // false if the thread got no epoch record, handle_ then owns a reference
+        bool pinned_;
+
+        explicit Snapshot(const AtomicStringHandle& slot);
+
+        friend class AtomicStringHandle;
+    };
+
+    AtomicStringHandle() = default;
+
+    explicit AtomicStringHandle(StringHandle value) : word_(Release(value)) {}
+
+    ~AtomicStringHandle();
+
+    AtomicStringHandle(const AtomicStringHandle&) = delete;
+    AtomicStringHandle& operator=(const AtomicStringHandle&) = delete;
+
+    /**
+     * A thread claims an epoch record on its first Read() and keeps it
+     * until it exits. Threads beyond MAX_READERS get a snapshot owning a
+     * reference, taken under a global mutex.
+     */
+    Snapshot Read() const {
+        return Snapshot{*this};
+    }
+
+    // a handle owning a reference, for keeping the value beyond a snapshot
+    StringHandle Load() const;
+
+    void Store(StringHandle value) {
+        Exchange(std::move(value));
+    }
+
+    // the previous value, which the caller then owns
+    StringHandle Exchange(StringHandle value);
+
+private:
+    std::atomic<std::uintptr_t> word_{0};
+
+    // takes the word out of value, which is left null
+    static std::uintptr_t Release(StringHandle& value) {
+        std::uintptr_t word = value.Ptr();
+        value.Ptr() = 0;
+        return word;
+    }
+
+    static StringHandle Adopt(std::uintptr_t word) {
+        StringHandle handle;
+        handle.Ptr() = word;
+        return handle;
+    }
+
+    // for a heap value, a handle borrowing it rather than owning a reference
+    static StringHandle Borrowed(std::uintptr_t word);
+
+    // a handle owning a new reference to the value
+    static StringHandle Copied(std::uintptr_t word);
+};
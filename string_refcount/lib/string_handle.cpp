@@ -1,4 +1,194 @@
 #include "string_handle.h"
+#include "string_interner.h"
+#include <vector>
+
+/**
+ * Follows the StringHeader of a rope node; flat is the cached contiguous
+ * copy, set once by the first get(). It is a heap string of its own, which
+ * takes the place of the node in ropes concatenated later.
+ */
+struct RopeBody {
+    StringHandle left, right;
+    std::atomic<char *> flat{nullptr};
+};
+
+/**
+ * Follows the StringHeader of a borrowed string; flat is the terminated
+ * copy, set once by the first get().
+ */
+struct ExternalBody {
+    const char *chars;
+    std::atomic<char *> flat{nullptr};
+};
+
+StringHandle StringHandle::OnHeap(const char *str) {
+    StringHandle handle;
+    if (str != nullptr) {
+        handle.ConstructOnHeap(str, std::strlen(str));
+    }
+    return handle;
+}
+
+StringHandle StringHandle::Borrow(const char *str, size_t length) {
+    if (length <= MAX_INLINE) {
+        return StringHandle{str, length};
+    }
+    void *block = ::operator new(sizeof(StringHeader) + sizeof(ExternalBody));
+    StringHeader *header = new (block) StringHeader{length, 0, 1};
+    ExternalBody *body = new (header + 1) ExternalBody{str};
+    StringHandle handle;
+    handle.Ptr() = reinterpret_cast<std::uintptr_t>(body) | HEAP_TAG | EXTERNAL_TAG;
+    return handle;
+}
+
+StringHandle StringHandle::Concat(const StringHandle& a, const StringHandle& b) {
+    // a rope may outlive the memory borrowed pieces point to
+    if (a.IsBorrowed() || b.IsBorrowed()) {
+        return Concat(StringHandle{a}.Own(), StringHandle{b}.Own());
+    }
+    if (b.size() == 0) {
+        return a;
+    }
+    if (a.size() == 0) {
+        return b;
+    }
+    size_t length = a.size() + b.size();
+    if (length <= MAX_INLINE) {
+        char chars[MAX_INLINE];
+        std::memcpy(chars, a.get(), a.size());
+        std::memcpy(chars + a.size(), b.get(), b.size());
+        return StringHandle{chars, length};
+    }
+    void *block = ::operator new(sizeof(StringHeader) + sizeof(RopeBody));
+    StringHeader *header = new (block) StringHeader{length, 0, 1};
+    RopeBody *body = new (header + 1) RopeBody{a.Flattened(), b.Flattened()};
+    StringHandle handle;
+    handle.Ptr() = reinterpret_cast<std::uintptr_t>(body) | HEAP_TAG | ROPE_TAG;
+    return handle;
+}
+
+/**
+ * Once a rope has been flattened, a piece concatenated to it is the flat
+ * copy: the node, and the copies cached below it, go with their last
+ * handle instead of living as long as the new rope. Appending to a string
+ * and reading it after each append thus keeps one copy alive, not one per
+ * append.
+ */
+StringHandle StringHandle::Flattened() const {
+    if (!IsRope()) {
+        return *this;
+    }
+    char *flat = Body()->flat.load(std::memory_order_acquire);
+    return flat ? Share(flat) : *this;
+}
+
+StringHandle StringHandle::Share(char *chars) {
+    StringHandle handle;
+    handle.Ptr() = reinterpret_cast<std::uintptr_t>(chars) | HEAP_TAG;
+    handle.IncCount();
+    return handle;
+}
+
+/**
+ * Walks the rope left to right with an explicit stack, copying leaves and
+ * the cached copies of inner nodes. Threads racing on the first call each
+ * build a copy, one of them is kept.
+ */
+const char *StringHandle::Flat() const {
+    RopeBody *body = Body();
+    char *flat = body->flat.load(std::memory_order_acquire);
+    if (flat) {
+        return flat;
+    }
+    StringHandle copy;
+    copy.ConstructOnHeap(nullptr, size());
+    char *chars = const_cast<char *>(copy.Data());
+    char *out = chars;
+    std::vector<const StringHandle *> pending{&body->right, &body->left};
+    while (!pending.empty()) {
+        const StringHandle *piece = pending.back();
+        pending.pop_back();
+        if (piece->IsRope()) {
+            const char *cached = piece->Body()->flat.load(std::memory_order_acquire);
+            if (!cached) {
+                pending.push_back(&piece->Body()->right);
+                pending.push_back(&piece->Body()->left);
+                continue;
+            }
+            std::memcpy(out, cached, piece->size());
+        } else {
+            std::memcpy(out, piece->get(), piece->size());
+        }
+        out += piece->size();
+    }
+    if (!body->flat.compare_exchange_strong(flat, chars, std::memory_order_acq_rel)) {
+        return flat;
+    }
+    // the node keeps the reference
+    copy.Ptr() = 0;
+    return chars;
+}
+
+const char *StringHandle::ExternalChars() const {
+    return External()->chars;
+}
+
+// threads racing on the first call each make a copy, one of them is kept
+const char *StringHandle::Terminated() const {
+    ExternalBody *body = External();
+    char *flat = body->flat.load(std::memory_order_acquire);
+    if (flat) {
+        return flat;
+    }
+    char *chars = new char[size() + 1];
+    std::memcpy(chars, body->chars, size());
+    chars[size()] = '\0';
+    if (!body->flat.compare_exchange_strong(flat, chars, std::memory_order_acq_rel)) {
+        delete[] chars;
+        return flat;
+    }
+    return chars;
+}
+
+void StringHandle::FreeExternal(StringHeader *header) {
+    ExternalBody *body = reinterpret_cast<ExternalBody *>(header + 1);
+    delete[] body->flat.load(std::memory_order_relaxed);
+    body->~ExternalBody();
+    header->~StringHeader();
+    ::operator delete(header);
+}
+
+/**
+ * Children which are ropes are released here rather than by their
+ * destructors, so that a deep rope does not free itself recursively.
+ */
+void StringHandle::FreeRope(StringHeader *header) {
+    std::vector<StringHeader *> dead{header};
+    while (!dead.empty()) {
+        StringHeader *node = dead.back();
+        dead.pop_back();
+        RopeBody *body = reinterpret_cast<RopeBody *>(node + 1);
+        for (StringHandle *child : {&body->left, &body->right}) {
+            if (!child->IsRope()) {
+                continue;
+            }
+            StringHeader *childHeader = child->Header();
+            if (childHeader->refs.load(std::memory_order_acquire) == 1
+                || childHeader->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                dead.push_back(childHeader);
+            }
+            child->Ptr() = 0;
+        }
+        if (char *flat = body->flat.load(std::memory_order_relaxed)) {
+            // releases the node's reference to its flat copy
+            StringHandle copy;
+            copy.Ptr() = reinterpret_cast<std::uintptr_t>(flat) | HEAP_TAG;
+        }
+        body->~RopeBody();
+        node->~StringHeader();
+        ::operator delete(node);
+    }
+}
 
 StringHandle& StringHandle::operator=(StringHandle&& oth) {
     if (&oth != this) {
@@ -9,11 +199,11 @@ StringHandle& StringHandle::operator=(StringHandle&& oth) {
     return *this;
 }
 
-StringHandle& StringHandle::operator=(StringHandle& oth) {
+StringHandle& StringHandle::operator=(const StringHandle& oth) {
     if (&oth != this) {
         FreeIfRequired();
-        oth.IncCount();
         this->str = oth.str;
+        IncCount();
     }
     return *this;
 }
@@ -24,6 +214,61 @@ StringHandle& StringHandle::operator=(const char *str) {
     return *this;
 }
 
+void StringHandle::ReleaseInterned() {
+    StringHeader *header = Header();
+    if (header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        #ifdef DEBUG
+        ++dealloc_count;
+        #endif
+        StringInterner::PrefixOf(header)->owner->Release(header);
+    }
+}
+
+StringInterner *StringHandle::Interner() const {
+    return StringInterner::PrefixOf(Header())->owner;
+}
+
+int StringHandle::compare(const StringHandle& oth) const {
+    if (IsInline() && oth.IsInline()) {
+        auto a = InlineKey(), b = oth.InlineKey();
+        if (a != b) {
+            return a < b ? -1 : 1;
+        }
+        return (size() > oth.size()) - (size() < oth.size());
+    }
+    int order = view().compare(oth.view());
+    return (order > 0) - (order < 0);
+}
+
+/**
+ * Inline strings are equal iff their words are, heap strings iff their
+ * pointers are when interned by the same interner; a borrowing handle
+ * differs from the owning one only in its tag. Other pairs are rejected on
+ * length or on hashes which are already known before comparing characters.
+ */
+bool operator==(const StringHandle& a, const StringHandle& b) {
+    if (a.str == b.str) {
+        return true;
+    }
+    if ((a.IsInline() && b.IsInline()) || a.size() != b.size()) {
+        return false;
+    }
+    if ((a.Ptr() & b.Ptr() & StringHandle::HEAP_TAG)) {
+        if ((a.Ptr() & StringHandle::PTR_MASK) == (b.Ptr() & StringHandle::PTR_MASK)) {
+            return true;
+        }
+        if (a.IsInterned() && b.IsInterned() && a.Interner() == b.Interner()) {
+            return false;
+        }
+        size_t hashA = a.Header()->hash.load(std::memory_order_relaxed);
+        size_t hashB = b.Header()->hash.load(std::memory_order_relaxed);
+        if (hashA && hashB && hashA != hashB) {
+            return false;
+        }
+    }
+    return a.view() == b.view();
+}
+
 std::ostream& operator<<(std::ostream& out, const StringHandle& a) {
     return out << "Content: " << a.get() << "\n" 
                 << "Count: " << a.Count() << "\n";
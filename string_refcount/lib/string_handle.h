@@ -1,30 +1,206 @@
 #pragma once
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
 #include <ostream>
 #include <cstring>
+#include <functional>
+#include <memory_resource>
+#include <new>
+#include <string_view>
 
+class StringInterner;
+struct RopeBody;
+struct ExternalBody;
+
+/**
+ * Lies in front of the characters of every heap string, in the same
+ * allocation. The 8-byte alignment keeps the low bits of the character
+ * pointer free.
+ */
+struct alignas(8) StringHeader {
+    size_t length;
+    // 0 until the first Hash() of the string
+    std::atomic<size_t> hash;
+    std::atomic<unsigned> refs;
+};
+
+/**
+ * One word, read through its top byte (the last byte in memory):
+ * - 0 in the whole word: null
+ * - HEAP_TAG set: the low 56 bits point at the characters of a heap string,
+ *   INTERNED_TAG or RESOURCE_TAG tell who owns its memory, ROPE_TAG marks
+ *   a lazy concatenation and EXTERNAL_TAG characters in memory owned by
+ *   someone else; with BORROWED_TAG the handle owns no reference
+ * - otherwise an inline string of up to MAX_INLINE characters in the low
+ *   bytes, the top byte holds MAX_INLINE - length, so for a full inline
+ *   string it doubles as the terminator
+ * get() of an inline string points into the handle itself, so unlike a
+ * heap string it moves with the handle.
+ */
 class StringHandle {
 public:
+    static constexpr size_t MAX_INLINE = sizeof(char *) - 1;
+
     StringHandle() : str(nullptr) {}
 
     StringHandle(const char *str) {
         ConstructFromCString(str);
     }
 
-    StringHandle(StringHandle& oth) {
-        oth.IncCount();
-        this->str = oth.str;
+    // the first length characters of str, which need not be terminated
+    StringHandle(const char *str, size_t length) {
+        ConstructFromChars(str, length);
+    }
+
+    /**
+     * A heap string is allocated from resource instead of operator new and
+     * freed back to it by its last handle; resource must outlive the
+     * handles. Inline strings stay inline.
+     */
+    StringHandle(const char *str, std::pmr::memory_resource *resource) {
+        if (str == nullptr) {
+            Ptr() = 0;
+            return;
+        }
+        ConstructFromChars(str, std::strlen(str), resource);
+    }
+
+    StringHandle(const char *str, size_t length, std::pmr::memory_resource *resource) {
+        ConstructFromChars(str, length, resource);
+    }
+
+    StringHandle(const StringHandle& oth) : str(oth.str) {
+        IncCount();
     }
     
     StringHandle(StringHandle&& oth) : str(oth.str) {
         oth.str = nullptr;
     }
 
+    // a heap string even if str is short, for a get() that survives moves
+    static StringHandle OnHeap(const char *str);
+
+    /**
+     * A handle pointing at the length characters at str without copying
+     * them, for strings in memory which outlives the handle, such as a
+     * mapped file. Only a small header holding the length is allocated, so
+     * str need not be terminated: view() reads the characters in place,
+     * get() copies them once. Copies of the handle share the header;
+     * Own() or concatenation copies the characters. Strings short enough
+     * to be inline are copied at once.
+     */
+    static StringHandle Borrow(const char *str, size_t length);
+
+    static StringHandle Borrow(const char *str) {
+        return str ? Borrow(str, std::strlen(str)) : StringHandle{};
+    }
+
+    /**
+     * Turns a borrowed handle into an owning one, for when the backing
+     * memory goes away: one borrowing another handle's string takes a
+     * reference, one borrowing external memory copies the characters.
+     */
+    StringHandle& Own() {
+        if (Ptr() & BORROWED_TAG) {
+            Ptr() &= ~BORROWED_TAG;
+            IncCount();
+        } else if ((Ptr() & HEAP_TAG) && (Ptr() & EXTERNAL_TAG)) {
+            *this = StringHandle{Data(), size()};
+        }
+        return *this;
+    }
+
     StringHandle& operator=(StringHandle&& oth);
-    StringHandle& operator=(StringHandle& oth);
+    StringHandle& operator=(const StringHandle& oth);
     StringHandle& operator=(const char *str);
 
+    // flattens a rope, see Concat, and copies external characters to terminate them, see Borrow
     const char *get() const {
-        return reinterpret_cast<const char *>(Ptr() & ALIGNED_PTR_MASK);
+        if (Ptr() & HEAP_TAG) {
+            if (Ptr() & EXTERNAL_TAG) [[unlikely]] {
+                return Terminated();
+            }
+            return Data();
+        }
+        return Ptr() ? reinterpret_cast<const char *>(&str) : nullptr;
+    }
+
+    size_t size() const {
+        if (Ptr() & HEAP_TAG) {
+            return Header()->length;
+        }
+        return Ptr() ? MAX_INLINE - (Ptr() >> TAG_SHIFT) : 0;
+    }
+
+    // null reads as the empty string; external characters are read in place
+    std::string_view view() const {
+        if (Ptr() & HEAP_TAG) {
+            return std::string_view{Data(), Header()->length};
+        }
+        return Ptr() ? std::string_view{get(), size()} : std::string_view{};
+    }
+
+    /**
+     * std::hash of view(), never 0. Computed once per heap string and
+     * shared by all its handles; racing first calls compute the same value.
+     */
+    size_t Hash() const {
+        if (!(Ptr() & HEAP_TAG)) {
+            return HashOf(view());
+        }
+        size_t hash = Header()->hash.load(std::memory_order_relaxed);
+        if (hash == 0) {
+            hash = HashOf(view());
+            Header()->hash.store(hash, std::memory_order_relaxed);
+        }
+        return hash;
+    }
+
+    // -1, 0 or 1 in lexicographic order, a null handle compares as the empty string
+    int compare(const StringHandle& oth) const;
+
+    friend bool operator==(const StringHandle& a, const StringHandle& b);
+
+    friend bool operator<(const StringHandle& a, const StringHandle& b) {
+        return a.compare(b) < 0;
+    }
+
+    /**
+     * A handle to the characters of a followed by those of b. Unless the
+     * result fits inline, nothing is copied: it is a rope node sharing a
+     * and b, which get() flattens into a contiguous copy on first use and
+     * keeps for later calls. size() and further concatenation do not
+     * flatten; ropes nest to any depth without recursion.
+     */
+    static StringHandle Concat(const StringHandle& a, const StringHandle& b);
+
+    friend StringHandle operator+(const StringHandle& a, const StringHandle& b) {
+        return Concat(a, b);
+    }
+
+    StringHandle& operator+=(const StringHandle& oth) {
+        return *this = Concat(*this, oth);
+    }
+
+    bool IsRope() const {
+        return Ptr() & ROPE_TAG;
+    }
+
+    bool IsInline() const {
+        return Ptr() && !(Ptr() & HEAP_TAG);
+    }
+
+    // the characters belong to another handle or to external memory, see Borrow
+    bool IsBorrowed() const {
+        return (Ptr() & HEAP_TAG) && (Ptr() & (BORROWED_TAG | EXTERNAL_TAG));
+    }
+
+    // made by a StringInterner, equal interned strings share one copy
+    bool IsInterned() const {
+        return Ptr() & INTERNED_TAG;
     }
 
     ~StringHandle() {
@@ -33,8 +209,12 @@ public:
 
     friend std::ostream& operator<<(std::ostream& out, const StringHandle& a);
 
+    // number of handles sharing the string: 0 for null ones and those borrowing another handle's, 1 for inline ones
     int Count() const {
-        return !(Ptr() & 1) + 1;
+        if (Owns()) {
+            return Header()->refs.load(std::memory_order_relaxed);
+        }
+        return IsInline() ? 1 : 0;
     }
 
     #ifdef DEBUG
@@ -48,20 +228,147 @@ private:
             Ptr() = 0;
             return;
         }
-        auto length = std::strlen(str) + 1;
-        this->str = new char[length];
-        std::memcpy(this->str, str, length);
-        Ptr() = Ptr() | 1;
+        ConstructFromChars(str, std::strlen(str));
     }
 
+    void ConstructFromChars(const char *str, size_t length, std::pmr::memory_resource *resource = nullptr) {
+        if (length <= MAX_INLINE) {
+            Ptr() = static_cast<std::uintptr_t>(MAX_INLINE - length) << TAG_SHIFT;
+            std::memcpy(&this->str, str, length);
+            return;
+        }
+        ConstructOnHeap(str, length, resource);
+    }
+
+    // strings from a resource have its pointer in front of the header; a null str leaves the characters to the caller
+    void ConstructOnHeap(const char *str, size_t length, std::pmr::memory_resource *resource = nullptr) {
+        void *block;
+        if (resource) {
+            auto owner = static_cast<std::pmr::memory_resource **>(
+                resource->allocate(ResourceBlockSize(length), alignof(StringHeader)));
+            *owner = resource;
+            block = owner + 1;
+        } else {
+            block = ::operator new(sizeof(StringHeader) + length + 1);
+        }
+        StringHeader *header = new (block) StringHeader{length, 0, 1};
+        char *chars = reinterpret_cast<char *>(header + 1);
+        if (str) {
+            std::memcpy(chars, str, length);
+        }
+        chars[length] = '\0';
+        Ptr() = reinterpret_cast<std::uintptr_t>(chars) | HEAP_TAG | (resource ? RESOURCE_TAG : 0);
+    }
+
+    static size_t ResourceBlockSize(size_t length) {
+        return sizeof(std::pmr::memory_resource *) + sizeof(StringHeader) + length + 1;
+    }
+
+    void Deallocate(StringHeader *header) {
+        if (Ptr() & ROPE_TAG) {
+            FreeRope(header);
+            return;
+        }
+        if (Ptr() & EXTERNAL_TAG) {
+            FreeExternal(header);
+            return;
+        }
+        size_t length = header->length;
+        header->~StringHeader();
+        if (Ptr() & RESOURCE_TAG) {
+            auto resource = reinterpret_cast<std::pmr::memory_resource **>(header) - 1;
+            (*resource)->deallocate(resource, ResourceBlockSize(length), alignof(StringHeader));
+            return;
+        }
+        ::operator delete(header);
+    }
+
+    /**
+     * A handle holding the only reference frees without an atomic
+     * read-modify-write: no other handle exists which could add one.
+     */
     void FreeIfRequired() {
-        if (OneOwner()) {
+        if (!Owns()) {
+            return;
+        }
+        if (Ptr() & INTERNED_TAG) {
+            ReleaseInterned();
+            return;
+        }
+        StringHeader *header = Header();
+        if (header->refs.load(std::memory_order_acquire) == 1
+            || header->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
             #ifdef DEBUG
-            fprintf(stderr, "Free str: %s, count: %i\n", get(), Count());
+            fprintf(stderr, "Free str: %s, count: %i\n", IsRope() ? "<rope>" : get(), Count());
             ++dealloc_count;
             #endif
-            delete[] get();
+            Deallocate(header);
+        }
+    }
+
+    // a heap string holding a reference of its own
+    bool Owns() const {
+        return (Ptr() & (HEAP_TAG | BORROWED_TAG)) == HEAP_TAG;
+    }
+
+    // the characters of a heap string, not terminated for external ones
+    const char *Data() const {
+        if (Ptr() & (ROPE_TAG | EXTERNAL_TAG)) [[unlikely]] {
+            return (Ptr() & ROPE_TAG) ? Flat() : ExternalChars();
         }
+        return reinterpret_cast<const char *>(Ptr() & PTR_MASK);
+    }
+
+    const char *Flat() const;
+
+    // this handle, or the flat copy of a rope which has one
+    StringHandle Flattened() const;
+
+    // a new handle to the heap string at chars
+    static StringHandle Share(char *chars);
+
+    const char *ExternalChars() const;
+
+    const char *Terminated() const;
+
+    RopeBody *Body() const {
+        return reinterpret_cast<RopeBody *>(Ptr() & PTR_MASK);
+    }
+
+    ExternalBody *External() const {
+        return reinterpret_cast<ExternalBody *>(Ptr() & PTR_MASK);
+    }
+
+    static void FreeExternal(StringHeader *header);
+
+    // frees a rope node at count 0 and all nodes below it which only it held
+    static void FreeRope(StringHeader *header);
+
+    /**
+     * Interned strings always decrement: their interner may hand out a new
+     * reference to a string with a single handle at any time.
+     */
+    void ReleaseInterned();
+
+    // IsInterned() only
+    StringInterner *Interner() const;
+
+    StringHeader *Header() const {
+        return reinterpret_cast<StringHeader *>(Ptr() & PTR_MASK) - 1;
+    }
+
+    static size_t HashOf(std::string_view chars) {
+        size_t hash = std::hash<std::string_view>{}(chars);
+        return hash ? hash : 1;
+    }
+
+    /**
+     * The characters of an inline string as a big-endian number with zero
+     * padding, which orders like the strings as long as they do not end in
+     * '\0': strings equal up to trailing zeros have the same key.
+     */
+    uint64_t InlineKey() const {
+        return __builtin_bswap64(static_cast<uint64_t>(Ptr() & PTR_MASK));
     }
 
     std::uintptr_t& Ptr() {
@@ -73,14 +380,28 @@ private:
     }
 
     void IncCount() {
-        Ptr() &= ALIGNED_PTR_MASK;
+        if (Owns()) {
+            Header()->refs.fetch_add(1, std::memory_order_relaxed);
+        }
     }
 
-    bool OneOwner() const {
-        return Ptr() & 1;
-    }
+    static_assert(std::endian::native == std::endian::little, "inline strings need the tag in the last byte");
+    static constexpr unsigned TAG_SHIFT = 8 * MAX_INLINE;
+    static constexpr std::uintptr_t HEAP_TAG = std::uintptr_t{0x80} << TAG_SHIFT;
+    // with HEAP_TAG only
+    static constexpr std::uintptr_t INTERNED_TAG = std::uintptr_t{0x40} << TAG_SHIFT;
+    // with HEAP_TAG only
+    static constexpr std::uintptr_t RESOURCE_TAG = std::uintptr_t{0x20} << TAG_SHIFT;
+    // with HEAP_TAG only, the low bits point at a RopeBody instead of characters
+    static constexpr std::uintptr_t ROPE_TAG = std::uintptr_t{0x10} << TAG_SHIFT;
+    // with HEAP_TAG only, the handle owns no reference: the string belongs to a handle which outlives it
+    static constexpr std::uintptr_t BORROWED_TAG = std::uintptr_t{0x08} << TAG_SHIFT;
+    // with HEAP_TAG only, the low bits point at an ExternalBody instead of characters; may be set in an inline string
+    static constexpr std::uintptr_t EXTERNAL_TAG = std::uintptr_t{0x04} << TAG_SHIFT;
+    static constexpr std::uintptr_t PTR_MASK = (std::uintptr_t{1} << TAG_SHIFT) - 1;
 
-    static constexpr uintptr_t ALIGNED_PTR_MASK = -2ul;
+    friend class StringInterner;
+    friend class AtomicStringHandle;
 
 private:
     char *str{nullptr};
@@ -89,3 +410,9 @@ private:
     #endif
 };
 
+template <>
+struct std::hash<StringHandle> {
+    size_t operator()(const StringHandle& handle) const {
+        return handle.Hash();
+    }
+};
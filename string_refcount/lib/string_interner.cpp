@@ -0,0 +1,89 @@
+#include "string_interner.h"
+
+StringInterner::~StringInterner() {
+    for (auto& shard : shards_) {
+        for (auto& [key, header] : shard.strings) {
+            header->~StringHeader();
+            ::operator delete(PrefixOf(header));
+        }
+    }
+}
+
+StringHandle StringInterner::Intern(std::string_view chars) {
+    if (chars.size() <= StringHandle::MAX_INLINE) {
+        return StringHandle{chars.data(), chars.size()};
+    }
+    size_t hash = StringHandle::HashOf(chars);
+    Shard& shard = ShardOf(hash);
+    std::lock_guard lock{shard.mutex};
+    ++shard.requests;
+    auto found = shard.strings.find(Key{hash, chars});
+    if (found != shard.strings.end()) {
+        // a string at 0 is being freed by its last handle, it must not come back
+        std::atomic<unsigned>& refs = found->second->refs;
+        unsigned count = refs.load(std::memory_order_relaxed);
+        while (count != 0 && !refs.compare_exchange_weak(count, count + 1, std::memory_order_relaxed)) {
+        }
+        if (count != 0) {
+            ++shard.hits;
+            StringHandle handle;
+            handle.Ptr() = reinterpret_cast<std::uintptr_t>(found->second + 1)
+                | StringHandle::HEAP_TAG | StringHandle::INTERNED_TAG;
+            return handle;
+        }
+        // the key points into the dying copy, so the entry must go, not just its value
+        shard.strings.erase(found);
+    }
+
+    void *block = ::operator new(AllocationSize(chars.size()));
+    Prefix *prefix = new (block) Prefix{this};
+    StringHeader *header = new (prefix + 1) StringHeader{chars.size(), hash, 1};
+    char *copy = reinterpret_cast<char *>(header + 1);
+    std::memcpy(copy, chars.data(), chars.size());
+    copy[chars.size()] = '\0';
+    shard.strings.emplace(Key{hash, std::string_view{copy, chars.size()}}, header);
+
+    StringHandle handle;
+    handle.Ptr() = reinterpret_cast<std::uintptr_t>(copy) | StringHandle::HEAP_TAG | StringHandle::INTERNED_TAG;
+    return handle;
+}
+
+StringHandle StringInterner::Intern(const StringHandle& handle) {
+    if (handle.IsInterned() && handle.Interner() == this) {
+        return StringHandle{handle}.Own();
+    }
+    return Intern(handle.view());
+}
+
+void StringInterner::Release(StringHeader *header) {
+    {
+        std::string_view chars{reinterpret_cast<char *>(header + 1), header->length};
+        Shard& shard = ShardOf(header->hash.load(std::memory_order_relaxed));
+        std::lock_guard lock{shard.mutex};
+        auto found = shard.strings.find(Key{header->hash.load(std::memory_order_relaxed), chars});
+        // a lookup which saw the count at 0 may have replaced the entry already
+        if (found != shard.strings.end() && found->second == header) {
+            shard.strings.erase(found);
+        }
+    }
+    header->~StringHeader();
+    ::operator delete(PrefixOf(header));
+}
+
+InternStats StringInterner::Stats() const {
+    InternStats stats;
+    for (const auto& shard : shards_) {
+        std::lock_guard lock{shard.mutex};
+        stats.strings += shard.strings.size();
+        stats.requests += shard.requests;
+        stats.hits += shard.hits;
+        for (const auto& [key, header] : shard.strings) {
+            size_t bytes = AllocationSize(key.chars.size());
+            unsigned refs = header->refs.load(std::memory_order_relaxed);
+            stats.bytes += bytes;
+            // a copy made by StringHandle has no Prefix
+            stats.savedBytes += (refs > 1 ? refs - 1 : 0) * (bytes - sizeof(Prefix));
+        }
+    }
+    return stats;
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include "string_handle.h"
+#include <array>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+struct InternStats {
+    // distinct strings in the table
+    size_t strings = 0;
+    // heap bytes of those strings, headers included
+    size_t bytes = 0;
+    // bytes the extra handles of interned strings would take as separate copies
+    size_t savedBytes = 0;
+    size_t requests = 0;
+    size_t hits = 0;
+};
+
+/**
+ * Hands out one shared heap string per distinct content, so that equal
+ * interned handles point to the same characters and compare by pointer.
+ * The table is split into SHARDS shards by hash, each behind its own mutex.
+ * An entry is dropped when its last handle goes away; a string whose last
+ * handle is being released concurrently with a lookup is not revived, the
+ * lookup makes a fresh copy instead.
+ * Short strings are returned inline and never enter the table.
+ * The interner must outlive every handle it returned.
+ */
+class StringInterner {
+public:
+    static constexpr size_t SHARDS = 64;
+
+    StringInterner() = default;
+    ~StringInterner();
+
+    StringInterner(const StringInterner&) = delete;
+    StringInterner& operator=(const StringInterner&) = delete;
+
+    StringHandle Intern(std::string_view chars);
+
+    StringHandle Intern(const char *str) {
+        return Intern(std::string_view{str});
+    }
+
+    // an interned copy of handle, or handle itself if it is already interned here
+    StringHandle Intern(const StringHandle& handle);
+
+    InternStats Stats() const;
+
+private:
+    struct Key {
+        size_t hash;
+        std::string_view chars;
+
+        bool operator==(const Key& oth) const {
+            return hash == oth.hash && chars == oth.chars;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            return key.hash;
+        }
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<Key, StringHeader *, KeyHash> strings;
+        size_t requests = 0;
+        size_t hits = 0;
+    };
+
+    // lies in front of the StringHeader of every interned string
+    struct Prefix {
+        StringInterner *owner;
+    };
+
+    static_assert(sizeof(Prefix) % alignof(StringHeader) == 0);
+
+    std::array<Shard, SHARDS> shards_;
+
+    Shard& ShardOf(size_t hash) {
+        return shards_[(hash >> 7) % SHARDS];
+    }
+
+    static size_t AllocationSize(size_t length) {
+        return sizeof(Prefix) + sizeof(StringHeader) + length + 1;
+    }
+
+    static Prefix *PrefixOf(StringHeader *header) {
+        return reinterpret_cast<Prefix *>(header) - 1;
+    }
+
+    // called by the last handle of an interned string
+    void Release(StringHeader *header);
+
+    friend class StringHandle;
+};
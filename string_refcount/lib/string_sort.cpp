@@ -0,0 +1,208 @@
+#include "string_sort.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+
+namespace {
+
+constexpr size_t PREFIX_BYTES = sizeof(uint64_t);
+// bucket 0 holds the strings which ended, bucket b + 1 those with byte b
+constexpr size_t BUCKETS = 257;
+// smaller ranges are sorted by comparison
+constexpr size_t RADIX_THRESHOLD = 64;
+// past that common prefix comparison takes over, it does not recurse per byte
+constexpr size_t MAX_RADIX_DEPTH = 256;
+constexpr size_t MIN_PARALLEL_SIZE = 1 << 14;
+
+struct Entry {
+    // bytes depth..depth + 7 of the string, big-endian, zero past its end
+    uint64_t prefix;
+    size_t index : 48;
+    // of the string, a 0 in the prefix may be padding or a byte of it;
+    // clamped, radix passes stop at MAX_RADIX_DEPTH
+    size_t size : 16;
+};
+
+constexpr size_t MAX_ENTRY_SIZE = (1 << 16) - 1;
+static_assert(MAX_RADIX_DEPTH + PREFIX_BYTES < MAX_ENTRY_SIZE, "clamped sizes must not end strings early");
+
+uint64_t LoadPrefix(std::string_view chars, size_t depth) {
+    uint64_t prefix = 0;
+    if (depth < chars.size()) {
+        std::memcpy(&prefix, chars.data() + depth, std::min(PREFIX_BYTES, chars.size() - depth));
+    }
+    return __builtin_bswap64(prefix);
+}
+
+unsigned ByteOf(uint64_t prefix, size_t byte) {
+    return (prefix >> (8 * (PREFIX_BYTES - 1 - byte))) & 0xff;
+}
+
+unsigned BucketOf(const Entry& entry, size_t depth, size_t byte) {
+    return depth + byte < entry.size ? ByteOf(entry.prefix, byte) + 1 : 0;
+}
+
+class RadixSorter {
+public:
+    RadixSorter(const std::vector<StringHandle>& strings, std::vector<Entry>& entries)
+        : strings_(strings), entries_(entries), buffer_(entries.size()) {}
+
+    /**
+     * Sorts entries [begin, end), which agree on their first depth bytes
+     * and on the bytes of the prefix before byte.
+     */
+    void Sort(size_t begin, size_t end, size_t depth, size_t byte) {
+        if (end - begin < RADIX_THRESHOLD || depth >= MAX_RADIX_DEPTH) {
+            SortByComparison(begin, end, depth);
+            return;
+        }
+        if (byte == PREFIX_BYTES) {
+            depth += PREFIX_BYTES;
+            byte = 0;
+            for (size_t i = begin; i < end; ++i) {
+                entries_[i].prefix = LoadPrefix(strings_[entries_[i].index].view(), depth);
+            }
+        }
+        std::array<size_t, BUCKETS + 1> offsets = Distribute(begin, end, depth, byte);
+        // the strings in bucket 0 ended, they are equal
+        for (size_t bucket = 1; bucket < BUCKETS; ++bucket) {
+            if (offsets[bucket + 1] - offsets[bucket] > 1) {
+                Sort(offsets[bucket], offsets[bucket + 1], depth, byte + 1);
+            }
+        }
+    }
+
+    /**
+     * The first split, on all threads: every thread counts and moves a
+     * slice of the entries. Returns the bucket boundaries.
+     */
+    std::array<size_t, BUCKETS + 1> DistributeParallel(unsigned threads) {
+        size_t size = entries_.size();
+        std::vector<std::array<size_t, BUCKETS>> counts(threads);
+        auto slice = [size, threads](unsigned t) {
+            return std::pair{size * t / threads, size * (t + 1) / threads};
+        };
+        RunOn(threads, [&](unsigned t) {
+            counts[t].fill(0);
+            auto [from, to] = slice(t);
+            for (size_t i = from; i < to; ++i) {
+                ++counts[t][BucketOf(entries_[i], 0, 0)];
+            }
+        });
+        std::array<size_t, BUCKETS + 1> offsets{};
+        size_t offset = 0;
+        for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            offsets[bucket] = offset;
+            for (unsigned t = 0; t < threads; ++t) {
+                size_t count = counts[t][bucket];
+                counts[t][bucket] = offset;
+                offset += count;
+            }
+        }
+        offsets[BUCKETS] = offset;
+        RunOn(threads, [&](unsigned t) {
+            auto [from, to] = slice(t);
+            for (size_t i = from; i < to; ++i) {
+                buffer_[counts[t][BucketOf(entries_[i], 0, 0)]++] = entries_[i];
+            }
+        });
+        entries_.swap(buffer_);
+        return offsets;
+    }
+
+    template <typename Work>
+    static void RunOn(unsigned threads, Work work) {
+        std::vector<std::thread> workers;
+        for (unsigned t = 1; t < threads; ++t) {
+            workers.emplace_back(work, t);
+        }
+        work(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+private:
+    const std::vector<StringHandle>& strings_;
+    std::vector<Entry>& entries_;
+    std::vector<Entry> buffer_;
+
+    std::array<size_t, BUCKETS + 1> Distribute(size_t begin, size_t end, size_t depth, size_t byte) {
+        std::array<size_t, BUCKETS + 1> offsets{};
+        for (size_t i = begin; i < end; ++i) {
+            ++offsets[BucketOf(entries_[i], depth, byte) + 1];
+        }
+        offsets[0] = begin;
+        for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+            offsets[bucket + 1] += offsets[bucket];
+        }
+        // all in one bucket: nothing to move
+        unsigned first = BucketOf(entries_[begin], depth, byte);
+        if (offsets[first + 1] - offsets[first] == end - begin) {
+            return offsets;
+        }
+        std::array<size_t, BUCKETS> next;
+        std::copy(offsets.begin(), offsets.end() - 1, next.begin());
+        for (size_t i = begin; i < end; ++i) {
+            buffer_[next[BucketOf(entries_[i], depth, byte)]++] = entries_[i];
+        }
+        std::copy(buffer_.begin() + begin, buffer_.begin() + end, entries_.begin() + begin);
+        return offsets;
+    }
+
+    void SortByComparison(size_t begin, size_t end, size_t depth) {
+        std::sort(entries_.begin() + begin, entries_.begin() + end, [this, depth](const Entry& a, const Entry& b) {
+            // padding ties with 0 bytes, so equal prefixes may still differ in length
+            if (a.prefix != b.prefix) {
+                return a.prefix < b.prefix;
+            }
+            return strings_[a.index].view().substr(depth) < strings_[b.index].view().substr(depth);
+        });
+    }
+};
+
+}  // namespace
+
+void SortStrings(std::vector<StringHandle>& strings, unsigned threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (strings.size() < MIN_PARALLEL_SIZE) {
+        threads = 1;
+    }
+    std::vector<Entry> entries(strings.size());
+    RadixSorter::RunOn(threads, [&](unsigned t) {
+        for (size_t i = strings.size() * t / threads; i < strings.size() * (t + 1) / threads; ++i) {
+            std::string_view chars = strings[i].view();
+            entries[i] = Entry{LoadPrefix(chars, 0), i, std::min(chars.size(), MAX_ENTRY_SIZE)};
+        }
+    });
+
+    RadixSorter sorter{strings, entries};
+    std::array<size_t, BUCKETS + 1> offsets = sorter.DistributeParallel(threads);
+    // the largest buckets go first, so that no thread is left with one at the end
+    std::vector<size_t> buckets;
+    for (size_t bucket = 1; bucket < BUCKETS; ++bucket) {
+        if (offsets[bucket + 1] - offsets[bucket] > 1) {
+            buckets.push_back(bucket);
+        }
+    }
+    std::sort(buckets.begin(), buckets.end(), [&offsets](size_t a, size_t b) {
+        return offsets[a + 1] - offsets[a] > offsets[b + 1] - offsets[b];
+    });
+    std::atomic<size_t> next{0};
+    RadixSorter::RunOn(threads, [&](unsigned) {
+        for (size_t i = next.fetch_add(1); i < buckets.size(); i = next.fetch_add(1)) {
+            sorter.Sort(offsets[buckets[i]], offsets[buckets[i] + 1], 0, 1);
+        }
+    });
+
+    std::vector<StringHandle> sorted;
+    sorted.reserve(strings.size());
+    for (const Entry& entry : entries) {
+        sorted.push_back(std::move(strings[entry.index]));
+    }
+    strings.swap(sorted);
+}
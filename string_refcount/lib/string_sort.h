@@ -0,0 +1,15 @@
+#pragma once
+#include "string_handle.h"
+#include <vector>
+
+/**
+ * Sorts strings in the order of operator<, null handles first with the
+ * empty strings. An MSD radix sort over the bytes of the strings, which
+ * runs on an array holding the next 8 bytes of every string next to its
+ * index and length, so that the strings themselves are read once per 8
+ * bytes of common prefix rather than on every comparison. Strings may
+ * contain '\0', their lengths tell where they end. The first byte splits the
+ * array on all threads, the buckets are then sorted in parallel.
+ * threads 0 means std::thread::hardware_concurrency().
+ */
+void SortStrings(std::vector<StringHandle>& strings, unsigned threads = 0);
@@ -1,16 +1,20 @@
 #include <gtest/gtest.h>
+#include "atomic_string_handle.h"
 #include "string_handle.h"
+#include "string_interner.h"
+#include "string_sort.h"
+#include <random>
+#include <algorithm>
+#include <memory_resource>
 #include <string>
-
-// manual free to disable leak sanitizer warning
-void ManualFree(const StringHandle& h1) {
-  delete[] h1.get();
-}
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 TEST(CreateTest, Default) {
   StringHandle h;
   EXPECT_EQ(h.get(), nullptr);
-  EXPECT_EQ(h.Count(), 2);
+  EXPECT_EQ(h.Count(), 0);
 }
 
 TEST(CreateTest, String) {
@@ -20,67 +24,65 @@ TEST(CreateTest, String) {
 }
 
 TEST(CreateTest, StringHandle) {
-  StringHandle h1{"hello"};
+  StringHandle h1{"hello there"};
   {
     StringHandle h2{h1};
-    EXPECT_STREQ(h2.get(), "hello");
+    EXPECT_STREQ(h2.get(), "hello there");
     EXPECT_EQ(h2.Count(), 2);
     EXPECT_EQ(h1.Count(), 2);
   }
-  ManualFree(h1);
+  EXPECT_EQ(h1.Count(), 1);
 }
 
 TEST(AssignTest, String) {
-  StringHandle h1{"hello"};
-  h1 = "world";
-  EXPECT_STREQ(h1.get(), "world");
+  StringHandle h1{"hello there"};
+  h1 = "world at large";
+  EXPECT_STREQ(h1.get(), "world at large");
   EXPECT_EQ(h1.Count(), 1);
   EXPECT_EQ(h1.DeallocCount(), 1);
 }
 
 TEST(AssignTest, StringHandle) {
-  StringHandle h1{"hello"};
-  StringHandle h2{"world"};
+  StringHandle h1{"hello there"};
+  StringHandle h2{"world at large"};
   h2 = h1;
-  EXPECT_STREQ(h2.get(), "hello");
+  EXPECT_STREQ(h2.get(), "hello there");
   EXPECT_EQ(h2.Count(), 2);
   EXPECT_EQ(h1.Count(), 2);
   EXPECT_EQ(h2.DeallocCount(), 1);
-  ManualFree(h1);
 }
 
 TEST(AssignTest, LeftNull) {
   StringHandle h{nullptr};
-  h = "foo";
+  h = "foo bar baz";
   EXPECT_EQ(h.Count(), 1);
-  EXPECT_STREQ(h.get(), "foo");
+  EXPECT_STREQ(h.get(), "foo bar baz");
   EXPECT_EQ(h.DeallocCount(), 0);
 }
 
 TEST(AssignTest, RightNull) {
-  StringHandle h{"foo"};
+  StringHandle h{"foo bar baz"};
   h = nullptr;
-  EXPECT_EQ(h.Count(), 2);
+  EXPECT_EQ(h.Count(), 0);
   EXPECT_EQ(h.get(), nullptr);
   EXPECT_EQ(h.DeallocCount(), 1);
 }
 
 TEST(AssignMoveTest, StringHandle) {
-  StringHandle h1{"hello"};
-  h1 = StringHandle{"world"};
-  EXPECT_STREQ(h1.get(), "world");
+  StringHandle h1{"hello there"};
+  h1 = StringHandle{"world at large"};
+  EXPECT_STREQ(h1.get(), "world at large");
   EXPECT_EQ(h1.Count(), 1);
   EXPECT_EQ(h1.DeallocCount(), 1);
 }
 
 TEST(SmokeTest, ThreePlusStrings) {
-  StringHandle h1{"hello"};
+  StringHandle h1{"hello there"};
   StringHandle h2{h1};
   StringHandle h3{h2};
-  EXPECT_EQ(h1.Count(), 2);
-  EXPECT_EQ(h2.Count(), 2);
-  EXPECT_EQ(h3.Count(), 2);
-  ManualFree(h1);
+  EXPECT_EQ(h1.Count(), 3);
+  EXPECT_EQ(h2.Count(), 3);
+  EXPECT_EQ(h3.Count(), 3);
 }
 
 TEST(SmokeTest, HeapAllocatedString) {
@@ -91,19 +93,506 @@ TEST(SmokeTest, HeapAllocatedString) {
 }
 
 TEST(SmokeTest, SelfRef) {
-  StringHandle h{"foo"};
+  StringHandle h{"foo bar baz"};
   h = h;
   EXPECT_EQ(h.Count(), 1);
   EXPECT_EQ(h.DeallocCount(), 0);
 }
 
 TEST(SmokeTest, SelfMoveRef) {
-  StringHandle h{"foo"};
+  StringHandle h{"foo bar baz"};
   h = std::move(h);
   EXPECT_EQ(h.Count(), 1);
   EXPECT_EQ(h.DeallocCount(), 0);
 }
 
+TEST(RefCountTest, LastOwnerFrees) {
+  StringHandle h1{"hello there"};
+  {
+    StringHandle h2{h1};
+    h2 = "world at large";
+    EXPECT_EQ(h2.DeallocCount(), 0);
+    EXPECT_EQ(h1.Count(), 1);
+  }
+  h1 = nullptr;
+  EXPECT_EQ(h1.DeallocCount(), 1);
+}
+
+TEST(RefCountTest, MoveKeepsCount) {
+  StringHandle h1{"hello there"};
+  StringHandle h2{h1};
+  StringHandle h3{std::move(h2)};
+  EXPECT_EQ(h2.get(), nullptr);
+  EXPECT_EQ(h1.Count(), 2);
+  EXPECT_EQ(h3.Count(), 2);
+}
+
+TEST(RefCountTest, ConcurrentCopies) {
+  StringHandle h{"shared string"};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&h]() {
+      for (int j = 0; j < 10000; ++j) {
+        StringHandle copy{h};
+        StringHandle other;
+        other = copy;
+        ASSERT_STREQ(other.get(), "shared string");
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(h.Count(), 1);
+}
+
+TEST(InlineTest, ShortStrings) {
+  StringHandle empty{""};
+  EXPECT_TRUE(empty.IsInline());
+  EXPECT_STREQ(empty.get(), "");
+  StringHandle h{"seven.."};
+  EXPECT_TRUE(h.IsInline());
+  EXPECT_STREQ(h.get(), "seven..");
+  StringHandle eight{"eight..."};
+  EXPECT_FALSE(eight.IsInline());
+  EXPECT_STREQ(eight.get(), "eight...");
+}
+
+TEST(InlineTest, CopiesNeverShare) {
+  StringHandle h1{"foo"};
+  StringHandle h2{h1};
+  StringHandle h3;
+  h3 = h2;
+  EXPECT_EQ(h1.Count(), 1);
+  EXPECT_EQ(h3.Count(), 1);
+  EXPECT_STREQ(h3.get(), "foo");
+  EXPECT_NE(h3.get(), h1.get());
+  h1 = "bar";
+  EXPECT_STREQ(h1.get(), "bar");
+  EXPECT_STREQ(h2.get(), "foo");
+  EXPECT_EQ(h1.DeallocCount(), 0);
+}
+
+TEST(InlineTest, Move) {
+  StringHandle h1{"abc"};
+  StringHandle h2{std::move(h1)};
+  EXPECT_EQ(h1.get(), nullptr);
+  EXPECT_STREQ(h2.get(), "abc");
+  h2 = StringHandle{"hello there"};
+  EXPECT_FALSE(h2.IsInline());
+  h2 = "abc";
+  EXPECT_TRUE(h2.IsInline());
+  EXPECT_EQ(h2.DeallocCount(), 1);
+}
+
+TEST(InlineTest, OnHeap) {
+  StringHandle h1 = StringHandle::OnHeap("abc");
+  EXPECT_FALSE(h1.IsInline());
+  const char *chars = h1.get();
+  StringHandle h2{h1};
+  StringHandle h3{std::move(h1)};
+  EXPECT_EQ(h3.get(), chars);
+  EXPECT_EQ(h2.Count(), 2);
+  EXPECT_STREQ(h3.get(), "abc");
+}
+
+TEST(CompareTest, Size) {
+  EXPECT_EQ(StringHandle{}.size(), 0u);
+  EXPECT_EQ(StringHandle{""}.size(), 0u);
+  EXPECT_EQ(StringHandle{"seven.."}.size(), 7u);
+  EXPECT_EQ(StringHandle{"hello world!"}.size(), 12u);
+  EXPECT_EQ(StringHandle::OnHeap("abc").size(), 3u);
+}
+
+TEST(CompareTest, Equal) {
+  StringHandle h1{"hello world!"};
+  StringHandle h2{"hello world!"};
+  StringHandle h3{"hello world?"};
+  EXPECT_EQ(h1, h2);
+  EXPECT_EQ(h1.Hash(), h2.Hash());
+  EXPECT_FALSE(h1 == h3);
+  EXPECT_FALSE(h1 == StringHandle{"hello"});
+  EXPECT_EQ(StringHandle{"abc"}, StringHandle::OnHeap("abc"));
+  EXPECT_FALSE(StringHandle{"abc"} == StringHandle{"abd"});
+  EXPECT_EQ(StringHandle{}, StringHandle{""});
+}
+
+TEST(CompareTest, Order) {
+  std::vector<const char *> sorted = {"", "a", "aa", "ab", "abcdefg", "abcdefgh", "b", "bbbbbbbbb"};
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    for (size_t j = 0; j < sorted.size(); ++j) {
+      StringHandle a{sorted[i]};
+      StringHandle b = StringHandle::OnHeap(sorted[j]);
+      int expected = i < j ? -1 : i > j;
+      EXPECT_EQ(a.compare(StringHandle{sorted[j]}), expected) << sorted[i] << " " << sorted[j];
+      EXPECT_EQ(a.compare(b) < 0, expected < 0) << sorted[i] << " " << sorted[j];
+      EXPECT_EQ(b.compare(a) > 0, expected < 0) << sorted[i] << " " << sorted[j];
+    }
+  }
+}
+
+TEST(CompareTest, EmbeddedNul) {
+  using namespace std::string_literals;
+  std::vector<std::string> sorted = {"", "\0"s, "\0\0"s, "a", "a\0"s, "a\0b"s, "abcdefg\0"s, "abcdefg\0\0"s};
+  for (size_t i = 0; i < sorted.size(); ++i) {
+    for (size_t j = 0; j < sorted.size(); ++j) {
+      StringHandle a{sorted[i].data(), sorted[i].size()};
+      StringHandle b{sorted[j].data(), sorted[j].size()};
+      int expected = i < j ? -1 : i > j;
+      EXPECT_EQ(a.compare(b), expected) << i << " " << j;
+      EXPECT_EQ(a == b, i == j) << i << " " << j;
+    }
+  }
+}
+
+TEST(CompareTest, HashMap) {
+  std::unordered_map<StringHandle, int> map;
+  map[StringHandle{"key"}] = 1;
+  map[StringHandle{"a much longer key"}] = 2;
+  EXPECT_EQ(map.at(StringHandle::OnHeap("key")), 1);
+  EXPECT_EQ(map.at(StringHandle{"a much longer key"}), 2);
+  EXPECT_EQ(map.count(StringHandle{"a much longer kez"}), 0u);
+}
+
+TEST(InternTest, SharesEqualStrings) {
+  StringInterner interner;
+  StringHandle h1 = interner.Intern("hello interned world");
+  std::string copy{"hello interned world"};
+  StringHandle h2 = interner.Intern(copy.c_str());
+  EXPECT_TRUE(h1.IsInterned());
+  EXPECT_EQ(h1.get(), h2.get());
+  EXPECT_EQ(h1.Count(), 2);
+  EXPECT_EQ(h1, h2);
+  EXPECT_FALSE(h1 == interner.Intern("hello interned world!"));
+  EXPECT_EQ(h1, StringHandle{"hello interned world"});
+  EXPECT_EQ(interner.Intern(StringHandle{"hello interned world"}).get(), h1.get());
+  EXPECT_EQ(interner.Intern(h1).get(), h1.get());
+  EXPECT_TRUE(interner.Intern("short").IsInline());
+}
+
+TEST(InternTest, LastHandleReclaims) {
+  StringInterner interner;
+  {
+    StringHandle h1 = interner.Intern("hello interned world");
+    StringHandle h2{h1};
+    StringHandle h3 = interner.Intern("hello interned world");
+    InternStats stats = interner.Stats();
+    EXPECT_EQ(stats.strings, 1u);
+    EXPECT_EQ(stats.requests, 2u);
+    EXPECT_EQ(stats.hits, 1u);
+    EXPECT_EQ(stats.savedBytes, 2 * (sizeof(StringHeader) + 21));
+    h1 = nullptr;
+    h2 = nullptr;
+    EXPECT_EQ(interner.Stats().strings, 1u);
+    h3 = nullptr;
+    EXPECT_EQ(h3.DeallocCount(), 1);
+  }
+  EXPECT_EQ(interner.Stats().strings, 0u);
+}
+
+TEST(InternTest, Concurrent) {
+  StringInterner interner;
+  std::vector<std::string> words;
+  for (int i = 0; i < 16; ++i) {
+    words.push_back("interned word number " + std::to_string(i));
+  }
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&interner, &words, i]() {
+      for (int j = 0; j < 2000; ++j) {
+        const std::string& word = words[(i + j) % words.size()];
+        StringHandle h = interner.Intern(word.c_str());
+        ASSERT_STREQ(h.get(), word.c_str());
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(interner.Stats().strings, 0u);
+}
+
+class CountingResource : public std::pmr::memory_resource {
+public:
+  int allocations = 0;
+  size_t outstanding = 0;
+
+protected:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    ++allocations;
+    outstanding += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+    outstanding -= bytes;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+};
+
+TEST(ResourceTest, LastOwnerFreesToResource) {
+  CountingResource resource;
+  {
+    StringHandle h1{"hello resource", &resource};
+    StringHandle h2{h1};
+    EXPECT_EQ(resource.allocations, 1);
+    EXPECT_GT(resource.outstanding, 14u);
+    EXPECT_STREQ(h2.get(), "hello resource");
+    EXPECT_EQ(h2.Count(), 2);
+    EXPECT_EQ(h1, StringHandle{"hello resource"});
+    h1 = "other string";
+    EXPECT_EQ(resource.allocations, 1);
+  }
+  EXPECT_EQ(resource.outstanding, 0u);
+}
+
+TEST(ResourceTest, InlineAndNull) {
+  CountingResource resource;
+  StringHandle h1{"short", &resource};
+  StringHandle h2{nullptr, &resource};
+  EXPECT_TRUE(h1.IsInline());
+  EXPECT_EQ(h2.get(), nullptr);
+  EXPECT_EQ(resource.allocations, 0);
+}
+
+TEST(ResourceTest, Monotonic) {
+  std::pmr::monotonic_buffer_resource arena;
+  std::vector<StringHandle> strings;
+  for (int i = 0; i < 100; ++i) {
+    std::string str = "arena string " + std::to_string(i);
+    strings.emplace_back(str.c_str(), str.size(), &arena);
+  }
+  EXPECT_STREQ(strings[42].get(), "arena string 42");
+  EXPECT_EQ(strings[42].size(), 15u);
+}
+
+TEST(RopeTest, Concat) {
+  StringHandle h1{"hello "};
+  StringHandle h2{"rope world"};
+  StringHandle h3 = h1 + h2;
+  EXPECT_TRUE(h3.IsRope());
+  EXPECT_EQ(h3.size(), 16u);
+  EXPECT_EQ(h2.Count(), 2);
+  EXPECT_STREQ(h3.get(), "hello rope world");
+  EXPECT_EQ(h3.get(), h3.get());
+  EXPECT_EQ(h3, StringHandle{"hello rope world"});
+  EXPECT_TRUE((StringHandle{"ab"} + StringHandle{"cd"}).IsInline());
+  EXPECT_STREQ((StringHandle{"ab"} + StringHandle{"cd"}).get(), "abcd");
+  EXPECT_EQ((StringHandle{} + h2).get(), h2.get());
+}
+
+TEST(RopeTest, Append) {
+  StringHandle fragment{"fragment "};
+  StringHandle log;
+  std::string expected;
+  for (int i = 0; i < 20000; ++i) {
+    log += fragment;
+    expected += fragment.get();
+    if (i == 100) {
+      EXPECT_STREQ(log.get(), expected.c_str());
+    }
+  }
+  EXPECT_EQ(log.size(), expected.size());
+  EXPECT_STREQ(log.get(), expected.c_str());
+  // the pieces appended up to the read are held by its flat copy
+  EXPECT_EQ(fragment.Count(), 20001 - 101);
+  log = nullptr;
+  EXPECT_EQ(fragment.Count(), 1);
+}
+
+TEST(RopeTest, ReadAfterEachAppend) {
+  StringHandle fragment{"fragment "};
+  StringHandle log;
+  std::string expected;
+  for (int i = 0; i < 2000; ++i) {
+    log += fragment;
+    expected += fragment.view();
+    ASSERT_EQ(log.get()[log.size() - 1], ' ');
+    // earlier nodes and their flat copies are gone, only the last piece is held
+    ASSERT_LE(fragment.Count(), 3);
+  }
+  EXPECT_EQ(log.view(), expected);
+  log = nullptr;
+  EXPECT_EQ(fragment.Count(), 1);
+}
+
+TEST(RopeTest, SharedPieces) {
+  StringHandle piece{"shared piece"};
+  StringHandle pair = piece + piece;
+  StringHandle quad = pair + pair;
+  StringHandle tail = quad + StringHandle{"!"};
+  EXPECT_STREQ(tail.get(), "shared pieceshared pieceshared pieceshared piece!");
+  EXPECT_STREQ(pair.get(), "shared pieceshared piece");
+  pair = nullptr;
+  quad = nullptr;
+  EXPECT_EQ(piece.Count(), 3);
+  tail = nullptr;
+  EXPECT_EQ(piece.Count(), 1);
+}
+
+TEST(RopeTest, ConcurrentFlatten) {
+  StringHandle rope = StringHandle{"concurrent "} + StringHandle{"flatten"};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([rope]() {
+      ASSERT_STREQ(rope.get(), "concurrent flatten");
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  EXPECT_STREQ(rope.get(), "concurrent flatten");
+}
+
+TEST(BorrowTest, PointsIntoBacking) {
+  char backing[] = "borrowed line\0second";
+  StringHandle h1 = StringHandle::Borrow(backing);
+  StringHandle h2{h1};
+  EXPECT_TRUE(h2.IsBorrowed());
+  EXPECT_EQ(h2.view().data(), backing);
+  EXPECT_EQ(h2.size(), 13u);
+  EXPECT_EQ(h2.Count(), 2);
+  EXPECT_EQ(h2, StringHandle{"borrowed line"});
+  EXPECT_TRUE(StringHandle::Borrow(backing + 14, 6).IsInline());
+}
+
+TEST(BorrowTest, Own) {
+  std::string backing{"borrowed line"};
+  StringHandle h = StringHandle::Borrow(backing.c_str(), backing.size());
+  StringHandle rope = h + h;
+  h.Own();
+  EXPECT_FALSE(h.IsBorrowed());
+  EXPECT_NE(h.get(), backing.c_str());
+  EXPECT_EQ(h.Count(), 1);
+  backing.assign(backing.size(), 'x');
+  EXPECT_STREQ(h.get(), "borrowed line");
+  EXPECT_STREQ(rope.get(), "borrowed lineborrowed line");
+}
+
+TEST(BorrowTest, Long) {
+  std::string backing(1000, 'a');
+  StringHandle h = StringHandle::Borrow(backing.c_str());
+  EXPECT_EQ(h.size(), 1000u);
+  EXPECT_EQ(h.view(), backing);
+}
+
+TEST(BorrowTest, Unterminated) {
+  using namespace std::string_literals;
+  std::string backing = "line with\0embedded NUL"s + std::string(300, 'b');
+  StringHandle h = StringHandle::Borrow(backing.data(), backing.size() - 1);
+  EXPECT_EQ(h.size(), backing.size() - 1);
+  EXPECT_EQ(h.view(), std::string_view(backing).substr(0, backing.size() - 1));
+  // get() terminates a copy of its own, once
+  const char *terminated = h.get();
+  EXPECT_NE(terminated, backing.data());
+  EXPECT_EQ(terminated[h.size()], '\0');
+  EXPECT_EQ(std::memcmp(terminated, backing.data(), h.size()), 0);
+  EXPECT_EQ(h.get(), terminated);
+  EXPECT_EQ(h.view().data(), backing.data());
+}
+
+TEST(AtomicTest, LoadStore) {
+  AtomicStringHandle slot{StringHandle{"first value"}};
+  EXPECT_STREQ(slot.Read().get(), "first value");
+  StringHandle loaded = slot.Load();
+  EXPECT_EQ(loaded.Count(), 2);
+  slot.Store(StringHandle{"second value"});
+  EXPECT_STREQ(slot.Load().get(), "second value");
+  EXPECT_STREQ(loaded.get(), "first value");
+  StringHandle previous = slot.Exchange(StringHandle{"abc"});
+  EXPECT_STREQ(previous.get(), "second value");
+  EXPECT_STREQ(slot.Read().get(), "abc");
+}
+
+TEST(AtomicTest, SnapshotOutlivesStore) {
+  AtomicStringHandle slot{StringHandle{"value before the store"}};
+  auto snapshot = slot.Read();
+  EXPECT_TRUE(snapshot.handle().IsBorrowed());
+  EXPECT_EQ(snapshot.handle().Count(), 0);
+  StringHandle owned{snapshot.handle()};
+  EXPECT_EQ(owned.Own(), slot.Load());
+  EXPECT_EQ(owned.view().data(), snapshot.handle().view().data());
+  for (int i = 0; i < 10; ++i) {
+    slot.Store(StringHandle{"value after the store"});
+  }
+  EXPECT_STREQ(snapshot.get(), "value before the store");
+  EXPECT_STREQ(slot.Read().get(), "value after the store");
+}
+
+TEST(AtomicTest, ReleasesReplacedValues) {
+  StringHandle first{"first value in the slot"};
+  StringHandle second{"second value in the slot"};
+  {
+    AtomicStringHandle slot{first};
+    slot.Store(second);
+    // no snapshot could see it, so the store released it
+    EXPECT_EQ(first.Count(), 1);
+    {
+      auto snapshot = slot.Read();
+      slot.Store(StringHandle{"third value in the slot"});
+      EXPECT_EQ(second.Count(), 2);
+    }
+    // the last snapshot released it, no further store needed
+    EXPECT_EQ(second.Count(), 1);
+    slot.Store(first);
+    EXPECT_EQ(first.Count(), 2);
+  }
+  EXPECT_EQ(first.Count(), 1);
+}
+
+TEST(AtomicTest, MoreReadersThanRecords) {
+  AtomicStringHandle slot{StringHandle{"value read by many threads"}};
+  const size_t count = AtomicStringHandle::MAX_READERS + 4;
+  std::atomic<size_t> reading{0};
+  std::atomic<size_t> borrowed{0};
+  std::vector<std::thread> readers;
+  for (size_t i = 0; i < count; ++i) {
+    readers.emplace_back([&]() {
+      auto snapshot = slot.Read();
+      borrowed += snapshot.handle().IsBorrowed();
+      // every snapshot is alive at the same time
+      ++reading;
+      while (reading.load() < count) {
+        std::this_thread::yield();
+      }
+      EXPECT_EQ(snapshot.view(), "value read by many threads");
+    });
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_LE(borrowed.load(), AtomicStringHandle::MAX_READERS);
+  EXPECT_LT(borrowed.load(), count);
+}
+
+TEST(AtomicTest, ConcurrentReadersAndWriter) {
+  AtomicStringHandle slot{StringHandle{"value number 0"}};
+  std::atomic<bool> done{false};
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&slot, &done]() {
+      while (!done.load()) {
+        auto snapshot = slot.Read();
+        ASSERT_EQ(snapshot.view().substr(0, 13), "value number ");
+        StringHandle loaded = slot.Load();
+        ASSERT_EQ(loaded.view().substr(0, 13), "value number ");
+      }
+    });
+  }
+  for (int i = 1; i <= 2000; ++i) {
+    slot.Store(StringHandle{("value number " + std::to_string(i)).c_str()});
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_STREQ(slot.Read().get(), "value number 2000");
+}
+
 TEST(SortTest, Bubble) {
   std::vector<StringHandle> strings;
   strings.emplace_back("baa");
@@ -130,3 +619,72 @@ TEST(SortTest, Bubble) {
     ASSERT_EQ(strings[i].Count(), 1);
   }
 }
+
+TEST(SortTest, StdSort) {
+  std::vector<StringHandle> strings;
+  for (const char *str : {"banana split", "apple", "cherry pie", "apple pie", "b"}) {
+    strings.emplace_back(str);
+  }
+  std::sort(strings.begin(), strings.end());
+  std::vector<const char *> sorted = {"apple", "apple pie", "b", "banana split", "cherry pie"};
+  for (size_t i = 0; i < strings.size(); ++i) {
+    ASSERT_STREQ(strings[i].get(), sorted[i]);
+  }
+}
+
+TEST(SortTest, Radix) {
+  std::mt19937 random(1);
+  std::vector<std::string> contents = {"", "a", "abcdefgh", "abcdefghi", "abcdefgh" "abcdefgh", std::string(300, 'z')};
+  // enough for SortStrings to use the threads
+  for (int i = 0; i < 20000; ++i) {
+    std::string str = i % 3 ? "common prefix " : "";
+    size_t length = random() % 20;
+    for (size_t j = 0; j < length; ++j) {
+      str += (char)('a' + random() % 3);
+    }
+    contents.push_back(str);
+  }
+  contents.push_back(std::string(300, 'z') + "a");
+  std::vector<StringHandle> strings;
+  strings.emplace_back();
+  for (const auto& str : contents) {
+    strings.emplace_back(str.c_str());
+  }
+  strings.push_back(StringHandle{"common "} + StringHandle{"prefix ab"});
+
+  std::vector<StringHandle> expected{strings};
+  std::sort(expected.begin(), expected.end());
+  for (unsigned threads : {1u, 4u}) {
+    std::vector<StringHandle> sorted{strings};
+    SortStrings(sorted, threads);
+    ASSERT_EQ(sorted.size(), expected.size());
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      ASSERT_EQ(sorted[i].view(), expected[i].view()) << i;
+    }
+  }
+}
+
+TEST(SortTest, RadixEmbeddedNul) {
+  using namespace std::string_literals;
+  std::vector<std::string> contents = {
+    "", "\0"s, "\0\0"s, "a", "a\0"s, "a\0\0"s, "a\0b"s, "ab",
+    "abcdefg\0"s, "abcdefg", "abcdefgh\0"s, "abcdefgh", "abcdefgh\0\0"s, "abcdefgh\0a"s,
+  };
+  // long enough runs of each for the radix passes, not just the comparison sort
+  std::vector<StringHandle> strings;
+  for (int i = 0; i < 100; ++i) {
+    for (const auto& str : contents) {
+      strings.emplace_back(str.data(), str.size());
+      strings.push_back(StringHandle::Borrow(str.data(), str.size()));
+    }
+  }
+  std::mt19937 random(1);
+  std::shuffle(strings.begin(), strings.end(), random);
+
+  std::vector<StringHandle> expected{strings};
+  std::sort(expected.begin(), expected.end());
+  SortStrings(strings, 1);
+  for (size_t i = 0; i < strings.size(); ++i) {
+    ASSERT_EQ(strings[i].view(), expected[i].view()) << i;
+  }
+}